@@ -0,0 +1,268 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "adapt.h"
+#include "layout.h"
+
+#define HIT_CHUNK_BITS	13
+#define HIT_CHUNK		(1 << HIT_CHUNK_BITS)
+#define HIT_CHUNKS		512		// node ids covered: HIT_CHUNKS * HIT_CHUNK
+
+
+// per-thread hit counters of nodes, allocated by chunks of node ids on demand
+typedef struct hit_table_t	HitTable;
+
+struct hit_table_t {
+	uint32_t	*chunk[HIT_CHUNKS];
+	HitTable	*next;
+};
+
+
+int					hit_sampling;
+__thread int		hit_skip;
+__thread HitTable	*hit_table;
+HitTable			*hit_tables;		// tables of all threads
+pthread_mutex_t		hit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+Arena				*hot_arena;			// node arrays of the hot paths
+
+
+
+/******************************************************************************
+ *
+ * Section for sampled per-thread hit counters
+ *
+ *****************************************************************************/
+
+void hit_count(Trie *v)
+{
+	uint32_t	*chunk;
+	int			c = v->id >> HIT_CHUNK_BITS;
+
+	hit_skip = hit_sampling;
+	if (hit_table == NULL) {
+		hit_table = calloc(1, sizeof(HitTable));
+		pthread_mutex_lock(&hit_lock);
+		hit_table->next = hit_tables;
+		hit_tables = hit_table;
+		pthread_mutex_unlock(&hit_lock);
+	}
+	if (c >= HIT_CHUNKS)
+		return;
+	chunk = hit_table->chunk[c];
+	if (chunk == NULL) {
+		chunk = calloc(HIT_CHUNK, sizeof(uint32_t));
+		__atomic_store_n(&hit_table->chunk[c], chunk, __ATOMIC_RELEASE);
+	}
+	// relaxed: only the owner thread counts, hit_merge() reads it concurrently
+	__atomic_fetch_add(&chunk[v->id & (HIT_CHUNK-1)], 1, __ATOMIC_RELAXED);
+}
+
+
+
+// sum up the counters of all threads for node ids < nhits
+void hit_merge(uint64_t *hits, int nhits)
+{
+	HitTable	*t;
+	uint32_t	*chunk;
+	int			id;
+
+	memset(hits, 0, nhits * sizeof(uint64_t));
+	pthread_mutex_lock(&hit_lock);
+	for (t = hit_tables; t != NULL; t = t->next) {
+		for (id = 0; id < nhits && id < HIT_CHUNKS*HIT_CHUNK; id++) {
+			chunk = __atomic_load_n(&t->chunk[id >> HIT_CHUNK_BITS], __ATOMIC_ACQUIRE);
+			if (chunk == NULL) {
+				id |= HIT_CHUNK - 1;
+				continue;
+			}
+			hits[id] += __atomic_load_n(&chunk[id & (HIT_CHUNK-1)], __ATOMIC_RELAXED);
+		}
+	}
+	pthread_mutex_unlock(&hit_lock);
+}
+
+
+
+// counts racing with the reset may survive it, they are statistics anyway
+void hit_reset()
+{
+	HitTable	*t;
+	int			c;
+
+	pthread_mutex_lock(&hit_lock);
+	for (t = hit_tables; t != NULL; t = t->next) {
+		for (c = 0; c < HIT_CHUNKS; c++) {
+			if (t->chunk[c] != NULL)
+				memset(t->chunk[c], 0, HIT_CHUNK * sizeof(uint32_t));
+		}
+	}
+	pthread_mutex_unlock(&hit_lock);
+}
+
+
+
+// hits of the subtree at v, also stored in sub[] for ids < nhits
+uint64_t subtree_hits(Trie *v, uint64_t *hits, uint64_t *sub, int nhits)
+{
+	uint64_t	n;
+	int			i;
+
+	n = v->id < nhits ? hits[v->id] : 0;
+	for (i = 0; i < v->nchildren; i++)
+		n += subtree_hits(&v->children[i], hits, sub, nhits);
+	if (v->id < nhits)
+		sub[v->id] = n;
+	return n;
+}
+
+
+
+void hit_report()
+{
+	uint64_t	*hits, total = 0, depth = 0, rules = 0, hottest = 0;
+	int			id, nhits = total_nodes, hot_id = 0;
+	Trie		*v;
+
+	hits = malloc(nhits * sizeof(uint64_t));
+	hit_merge(hits, nhits);
+	for (id = 0; id < nhits; id++) {
+		v = trie_nodes[id];
+		total += hits[id];
+		depth += hits[id] * v->depth;
+		if (v->nchildren == 0)
+			rules += hits[id] * v->nrules;
+		if (hits[id] > hottest) {
+			hottest = hits[id];
+			hot_id = id;
+		}
+	}
+	if (total > 0)
+		printf("hits: %lu sampled lookups, mean depth %.2f, mean leaf rules %.2f, "
+				"hottest node N%d %.1f%%\n", total, (double) depth / total,
+				(double) rules / total, hot_id, 100.0 * hottest / total);
+	free(hits);
+}
+
+
+
+/******************************************************************************
+ *
+ * Section for reshaping hot subtrees
+ *
+ *****************************************************************************/
+
+// nodes created after the hits were merged come from rebuilding hot leaves
+uint64_t node_hits(Trie *v, uint64_t *sub, int nsub)
+{
+	return v->id >= nsub ? UINT64_MAX : sub[v->id];
+}
+
+
+
+int is_hot(Trie *v, uint64_t *sub, int nsub, uint64_t threshold)
+{
+	return node_hits(v, sub, nsub) >= threshold;
+}
+
+
+
+size_t hot_bytes(Trie *v, uint64_t *sub, int nsub, uint64_t threshold)
+{
+	size_t	bytes = 0;
+	int		i;
+
+	if (v->nchildren == 0)
+		return 0;
+	if (is_hot(v, sub, nsub, threshold))
+		bytes = children_bytes(v);
+	for (i = 0; i < v->nchildren; i++)
+		bytes += hot_bytes(&v->children[i], sub, nsub, threshold);
+	return bytes;
+}
+
+
+
+// move the children array of hot v into the arena and recurse into the hottest child first;
+// arrays of cold nodes stay where they are unless they were in the old arena
+void hot_place(Trie *v, uint64_t *sub, int nsub, uint64_t threshold, Arena *old_arena)
+{
+	int		order[MAX_CHILDREN], i, j;
+
+	if (v->nchildren == 0)
+		return;
+
+	if (is_hot(v, sub, nsub, threshold))
+		place_children(v, hot_arena);
+	else if (arena_contains(old_arena, v->children))
+		place_children(v, NULL);
+
+	// hottest child first, the new ones (not counted yet) before all
+	for (i = 0; i < v->nchildren; i++) {
+		for (j = i; j > 0; j--) {
+			if (node_hits(&v->children[order[j-1]], sub, nsub) >= node_hits(&v->children[i], sub, nsub))
+				break;
+			order[j] = order[j-1];
+		}
+		order[j] = i;
+	}
+	for (i = 0; i < v->nchildren; i++)
+		hot_place(&v->children[order[i]], sub, nsub, threshold, old_arena);
+}
+
+
+
+// lay out the node arrays on hot paths contiguously, return the bytes laid out; the old hot
+// arena is emptied and so retired
+size_t hot_layout(Trie *root, uint64_t *sub, int nsub, uint64_t threshold)
+{
+	Arena	*old_arena = hot_arena;
+	size_t	bytes;
+
+	bytes = hot_bytes(root, sub, nsub, threshold);
+	hot_arena = bytes > 0 ? arena_new(bytes, 0) : NULL;
+	hot_place(root, sub, nsub, threshold, old_arena);
+	return bytes;
+}
+
+
+
+// rebuild the leaves taking at least hot_share of the sampled lookups with hot_leaf_rules, and
+// lay out the hot paths contiguously. Lookups may run meanwhile, but not build_trie();
+// layout_reclaim() frees the replaced memory afterwards. Return #leaves rebuilt
+int reshape_trie(Trie *root, int hot_leaf_rules, double hot_share)
+{
+	uint64_t	*hits, *sub, total, threshold;
+	Trie		**hot, *v;
+	int			nhits = total_nodes, nhot = 0, nrebuilt = 0, nadded = 0, i, n;
+	size_t		bytes = 0;
+
+	hits = malloc(nhits * sizeof(uint64_t));
+	sub = malloc(nhits * sizeof(uint64_t));
+	hot = malloc(nhits * sizeof(Trie *));
+	hit_merge(hits, nhits);
+	total = subtree_hits(root, hits, sub, nhits);
+	threshold = total * hot_share;
+	threshold = threshold == 0 ? 1 : threshold;
+
+	for (i = 0; i < nhits && total > 0; i++) {
+		v = trie_nodes[i];
+		if (v->nchildren == 0 && hits[i] >= threshold && v->nrules > hot_leaf_rules)
+			hot[nhot++] = v;
+	}
+	for (i = 0; i < nhot; i++) {
+		n = rebuild_node(hot[i], hot_leaf_rules);
+		nrebuilt += n > 0;
+		nadded += n;
+	}
+	if (total > 0)
+		bytes = hot_layout(root, sub, nhits, threshold);
+
+	printf("reshape: %d/%d hot leaves rebuilt with leaf rules %d, %d nodes added, "
+			"%lu bytes of node arrays laid out hot\n", nrebuilt, nhot, hot_leaf_rules, nadded, bytes);
+	free(hits);
+	free(sub);
+	free(hot);
+	return nrebuilt;
+}
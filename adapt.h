@@ -0,0 +1,25 @@
+#ifndef ADAPT_H
+#define ADAPT_H
+
+#include "trie.h"
+
+#define HIT_SAMPLE_RATE	16		// default: count one lookup out of this many
+#define HOT_SHARE		0.001	// default: share of lookups making a leaf hot
+
+extern int			hit_sampling;	// count one lookup out of hit_sampling, 0 for off
+extern __thread int	hit_skip;
+
+// count the node where a lookup ends, sampled; costs one test when sampling is off
+#define HIT_SAMPLE(v)	do {										\
+		if (hit_sampling && --hit_skip <= 0)						\
+			hit_count(v);											\
+	} while (0)
+
+
+void hit_count(Trie *v);
+void hit_reset();
+void hit_report();
+
+int reshape_trie(Trie *root, int hot_leaf_rules, double hot_share);
+
+#endif
@@ -0,0 +1,71 @@
+#!/bin/sh
+# build and lookup regression run of make bench: generates the ClassBench-style rule sets,
+# appends a row per set and leaf size to $OUT and compares it with $BASELINE
+#
+#   TYPES, SIZES, LEAVES   the sets and leaf_rules values run; the 100000-rule fw and ipc
+#                          sets stop at the 3M node limit of build_trie() with small leaves
+#   TOL                    percent the nodes or bytes/rule may grow by before the run fails
+#   TIME_TOL               the same for the build time and the lookup rate, which are noisy
+#   UPDATE=1               replace the baseline by this run instead of checking
+
+TYPES=${TYPES:-"acl fw ipc"}
+SIZES=${SIZES:-"1000 10000"}
+LEAVES=${LEAVES:-"4 8 16"}
+TOL=${TOL:-5}
+TIME_TOL=${TIME_TOL:-40}
+SEED=${SEED:-1}
+DIR=bench/data
+OUT=$DIR/current.csv
+BASELINE=${BASELINE:-bench/baseline.csv}
+HEADER="set,rules,leaf_rules,build_ms,nodes,leaves,max_depth,depth_nodes,bytes_per_rule,mpps"
+
+mkdir -p $DIR
+echo $HEADER > $OUT
+for type in $TYPES; do
+	for size in $SIZES; do
+		set=$type$((size / 1000))k
+		if [ ! -f $DIR/$set ]; then
+			./bench/classbench $type $size $SEED $DIR/$set $DIR/$set.trace || exit 1
+		fi
+		for leaf in $LEAVES; do
+			./main-bench -b $OUT $leaf $DIR/$set $DIR/$set.trace > $DIR/$set.$leaf.log || exit 1
+			if ! grep -q "trace: .* 0 mismatches" $DIR/$set.$leaf.log; then
+				echo "$set leaf $leaf: lookups mismatch the linear search"
+				exit 1
+			fi
+			tail -n 1 $OUT
+		done
+	done
+done
+
+if [ "$UPDATE" = 1 ] || [ ! -f $BASELINE ]; then
+	cp $OUT $BASELINE
+	echo "baseline written to $BASELINE"
+	exit 0
+fi
+
+# a row regresses when nodes or bytes_per_rule grow by more than TOL percent of the baseline
+# row of the same set and leaf size, or build_ms grows or mpps drops by more than TIME_TOL;
+# builds under half a second are left to the noise
+awk -F, -v tol=$TOL -v time_tol=$TIME_TOL '
+	FNR == 1 { next }
+	FNR == NR { base[$1 "," $3] = $0; next }
+	!(($1 "," $3) in base) { print $1 " leaf " $3 ": not in the baseline"; next }
+	{
+		split(base[$1 "," $3], b, ",")
+		if (b[4] >= 500 && $4 > b[4] * (1 + time_tol / 100))
+			bad = bad sprintf("%s leaf %s: build %.1f ms, baseline %.1f ms\n", $1, $3, $4, b[4])
+		if ($5 > b[5] * (1 + tol / 100))
+			bad = bad sprintf("%s leaf %s: %d nodes, baseline %d\n", $1, $3, $5, b[5])
+		if ($9 > b[9] * (1 + tol / 100))
+			bad = bad sprintf("%s leaf %s: %.1f bytes/rule, baseline %.1f\n", $1, $3, $9, b[9])
+		if ($10 < b[10] * (1 - time_tol / 100))
+			bad = bad sprintf("%s leaf %s: %.2f Mpps, baseline %.2f\n", $1, $3, $10, b[10])
+	}
+	END {
+		if (bad != "") {
+			printf "regressions beyond %d%% (%d%% for times):\n%s", tol, time_tol, bad
+			exit 1
+		}
+		printf "no regression beyond %d%% (%d%% for times) of the baseline\n", tol, time_tol
+	}' $BASELINE $OUT
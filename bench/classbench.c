@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+
+// ClassBench-style rule set and header trace generator for the bench target: the rules
+// nest their addresses in a few address trees like the ClassBench seeds, with the prefix
+// length, port class and protocol mixes of the acl, fw and ipc seed families
+
+#define NBASES		256		// address tree roots per field
+#define TRACE_SIZE	100000
+#define TRACE_NOISE	5		// one header in TRACE_NOISE is uniform random
+
+
+typedef struct {
+	uint32_t	lo, hi;
+} Range;
+
+typedef struct {
+	Range		field[5];
+} Rule;
+
+// port classes of the ClassBench seeds
+enum {WC, HI, LO, AR, EM};
+
+typedef struct {
+	char		*name;
+	int			sprefix[33];	// weights of the prefix lengths
+	int			dprefix[33];
+	int			sport[5];		// weights of the port classes
+	int			dport[5];
+	int			proto[4];		// weights of TCP, UDP, ICMP, any
+} Profile;
+
+Profile	profiles[] = {
+	// access lists: mostly specific destinations and exact destination ports
+	{"acl",
+	 {[0] = 10, [16] = 6, [20] = 4, [24] = 18, [28] = 6, [32] = 30},
+	 {[0] = 4, [16] = 4, [24] = 12, [28] = 6, [32] = 60},
+	 {[WC] = 90, [HI] = 5, [LO] = 2, [AR] = 1, [EM] = 2},
+	 {[WC] = 20, [HI] = 8, [LO] = 2, [AR] = 10, [EM] = 60},
+	 {60, 25, 5, 10}},
+	// firewalls: wildcards and port ranges, overlapping widely
+	{"fw",
+	 {[0] = 12, [16] = 8, [24] = 24, [28] = 8, [32] = 48},
+	 {[0] = 15, [16] = 10, [24] = 24, [28] = 6, [32] = 41},
+	 {[WC] = 60, [HI] = 15, [LO] = 5, [AR] = 10, [EM] = 10},
+	 {[WC] = 30, [HI] = 15, [LO] = 5, [AR] = 20, [EM] = 30},
+	 {45, 25, 5, 25}},
+	// IP chains: a mix of both, exact ports on either side
+	{"ipc",
+	 {[0] = 10, [16] = 8, [24] = 20, [28] = 6, [32] = 52},
+	 {[0] = 8, [16] = 8, [24] = 22, [28] = 5, [32] = 55},
+	 {[WC] = 55, [HI] = 10, [LO] = 5, [AR] = 5, [EM] = 25},
+	 {[WC] = 35, [HI] = 10, [LO] = 5, [AR] = 10, [EM] = 40},
+	 {50, 30, 10, 10}},
+};
+
+Range	well_known[] = {{80, 80}, {443, 443}, {53, 53}, {25, 25}, {22, 22}, {1521, 1521},
+						{3306, 3306}, {8080, 8080}, {123, 123}, {161, 162}, {6000, 6063},
+						{1000, 1999}, {5060, 5061}, {137, 139}};
+uint64_t	rng_state;
+uint32_t	sbase[NBASES], dbase[NBASES];
+
+
+
+// xorshift64*, so that a seed gives the same sets on every libc
+uint32_t rng()
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return (rng_state * 0x2545F4914F6CDD1DULL) >> 32;
+}
+
+
+
+uint32_t rng_range(uint32_t lo, uint32_t hi)
+{
+	return hi - lo == UINT32_MAX ? rng() : lo + rng() % (hi - lo + 1);
+}
+
+
+
+int pick(int *weights, int n)
+{
+	int		i, sum = 0, x;
+
+	for (i = 0; i < n; i++)
+		sum += weights[i];
+	x = rng() % sum;
+	for (i = 0; x >= weights[i]; i++)
+		x -= weights[i];
+	return i;
+}
+
+
+
+// a prefix under one of the address tree roots: the roots share their top byte with a few
+// others, and the last byte is drawn afresh half the time
+Range gen_prefix(uint32_t *bases, int len)
+{
+	uint32_t	ip = bases[rng() % NBASES], mask;
+
+	if (len == 0)
+		return (Range) {0, UINT32_MAX};
+	if (rng() & 1)
+		ip ^= rng() & 0xFF;
+	mask = len == 32 ? UINT32_MAX : ~(UINT32_MAX >> len);
+	return (Range) {ip & mask, (ip & mask) | ~mask};
+}
+
+
+
+Range gen_port(int class)
+{
+	uint32_t	a, b;
+
+	switch (class) {
+	case WC:
+		return (Range) {0, 65535};
+	case HI:
+		return (Range) {1024, 65535};
+	case LO:
+		return (Range) {0, 1023};
+	case AR:
+		if (rng() % 3)
+			return well_known[10 + rng() % 4];
+		a = rng() & 0xFFFF;
+		b = a + (rng() & 0x3FF);
+		return (Range) {a, b > 65535 ? 65535 : b};
+	default:
+		return rng() % 4 ? well_known[rng() % 10] : (Range) {a = rng() & 0xFFFF, a};
+	}
+}
+
+
+
+void gen_rules(Profile *p, Rule *rules, int n)
+{
+	int		i, slen, dlen, proto;
+
+	for (i = 0; i < NBASES; i++) {
+		sbase[i] = (sbase[i / 4 * 4] & 0xFF000000) | (rng() & (i % 4 ? 0xFFFFFF : UINT32_MAX));
+		dbase[i] = (dbase[i / 4 * 4] & 0xFF000000) | (rng() & (i % 4 ? 0xFFFFFF : UINT32_MAX));
+	}
+	for (i = 0; i < n; i++) {
+		// like the ClassBench address scope, one side of a rule is specific: rules wide on
+		// both addresses would shadow most of the rules after them. The default rule comes last
+		do {
+			slen = pick(p->sprefix, 33);
+			dlen = pick(p->dprefix, 33);
+		} while (slen < 24 && dlen < 24);
+		rules[i].field[0] = gen_prefix(sbase, slen);
+		rules[i].field[1] = gen_prefix(dbase, dlen);
+		if (i == n - 1)
+			rules[i].field[0] = rules[i].field[1] = (Range) {0, UINT32_MAX};
+		proto = pick(p->proto, 4);
+		if (proto <= 1) {
+			rules[i].field[2] = gen_port(pick(p->sport, 5));
+			rules[i].field[3] = gen_port(pick(p->dport, 5));
+		} else {
+			rules[i].field[2] = rules[i].field[3] = (Range) {0, 65535};
+		}
+		rules[i].field[4] = proto == 0 ? (Range) {6, 6} : proto == 1 ? (Range) {17, 17}
+						  : proto == 2 ? (Range) {1, 1} : (Range) {0, 255};
+	}
+	rules[n-1].field[2] = rules[n-1].field[3] = (Range) {0, 65535};
+	rules[n-1].field[4] = (Range) {0, 255};
+}
+
+
+
+inline int prefix_len(Range r)
+{
+	return 32 - __builtin_popcount(r.hi - r.lo);
+}
+
+
+
+void write_rules(FILE *fp, Rule *rules, int n)
+{
+	Range	*f;
+	int		i;
+
+	for (i = 0; i < n; i++) {
+		f = rules[i].field;
+		fprintf(fp, "@%u.%u.%u.%u/%d\t%u.%u.%u.%u/%d\t%u : %u\t%u : %u\t0x%02x/0x%02x\n",
+				f[0].lo >> 24, f[0].lo >> 16 & 0xFF, f[0].lo >> 8 & 0xFF, f[0].lo & 0xFF,
+				prefix_len(f[0]),
+				f[1].lo >> 24, f[1].lo >> 16 & 0xFF, f[1].lo >> 8 & 0xFF, f[1].lo & 0xFF,
+				prefix_len(f[1]),
+				f[2].lo, f[2].hi, f[3].lo, f[3].hi,
+				f[4].lo, f[4].lo == f[4].hi ? 0xFF : 0);
+	}
+}
+
+
+
+// headers drawn inside a random rule, plus uniform random ones
+void write_trace(FILE *fp, Rule *rules, int n, int npackets)
+{
+	Range	*f;
+	int		i, dim;
+
+	for (i = 0; i < npackets; i++) {
+		f = rules[rng() % n].field;
+		for (dim = 0; dim < 5; dim++) {
+			if (rng() % TRACE_NOISE == 0)
+				fprintf(fp, "%u\t", dim < 2 ? rng() : dim < 4 ? rng() & 0xFFFF : (rng() & 1 ? 6 : 17));
+			else
+				fprintf(fp, "%u\t", rng_range(f[dim].lo, f[dim].hi));
+		}
+		fprintf(fp, "0\n");
+	}
+}
+
+
+
+int main(int argc, char *argv[])
+{
+	Profile	*p = NULL;
+	Rule	*rules;
+	FILE	*fp;
+	int		n, i;
+
+	if (argc < 6) {
+		printf("%s acl|fw|ipc nrules seed rule_file trace_file [npackets]\n", argv[0]);
+		return 1;
+	}
+	for (i = 0; i < sizeof(profiles) / sizeof(Profile); i++) {
+		if (strcmp(argv[1], profiles[i].name) == 0)
+			p = &profiles[i];
+	}
+	if (p == NULL || (n = atoi(argv[2])) <= 0) {
+		fprintf(stderr, "Unknown rule set %s of %s rules\n", argv[1], argv[2]);
+		return 1;
+	}
+	rng_state = strtoull(argv[3], NULL, 0) * 0x9E3779B97F4A7C15ULL + 1;
+
+	rules = malloc(n * sizeof(Rule));
+	gen_rules(p, rules, n);
+	if ((fp = fopen(argv[4], "w")) == NULL) {
+		fprintf(stderr, "Failed to open %s\n", argv[4]);
+		return 1;
+	}
+	write_rules(fp, rules, n);
+	fclose(fp);
+	if ((fp = fopen(argv[5], "w")) == NULL) {
+		fprintf(stderr, "Failed to open %s\n", argv[5]);
+		return 1;
+	}
+	write_trace(fp, rules, n, argc > 6 ? atoi(argv[6]) : TRACE_SIZE);
+	fclose(fp);
+	free(rules);
+	return 0;
+}
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "common.h"
 #include "bitband.h"
 
@@ -28,59 +29,278 @@ int band_msb(int band_id)
 
 
 
-// strip off some bits of a rule field according to the cut, return 0 when fail
+// remove the bits of a band from a, bits above the band are shifted down to fill the hole
+inline
+uint32_t band_strip(uint32_t a, int bid)
+{
+	int			lo = band_lsb(bid);
+	uint64_t	lsb_mask = (1ULL << lo) - 1;
+
+	return (uint32_t) ((((uint64_t) a >> (lo + BAND_BITS)) << lo) | (a & lsb_mask));
+}
+
+
+
+// strip off some bits of a rule field according to the cut, return 0 when fail.
+// branch-free: the bits above the band are stepped by one when the band of range.lo (range.hi)
+// passes val, so that no value of the original range is lost or added; 64-bit arithmetic
+// takes care of the overflow (underflow) cases which have no overlap with the cut space
 int range_strip(Range *range, int bid, uint32_t val)
 {
 	int			lo, hi;
-	uint32_t	bits, n, msb, lsb;
+	uint32_t	bits;
+	uint64_t	lsb_mask, eq;
+	int64_t		msb, lsb, new_lo, new_hi;
 
 	lo = band_lsb(bid); hi = band_msb(bid);
+	lsb_mask = (1ULL << lo) - 1;
 
 	// compute range.lo
 	bits = extract_bits(range->lo, hi, lo);
-	if (bits > val) {
-		if (hi == 31)
-			return 0;	// no overlap with the cut space
-		n = range->lo + (1 << (hi+1));
-		if (n < range->lo)
-			return 0;	// overflow, no overlap
-		range->lo = n;
-	}
-	if (lo == 0)
-		lsb = 0;
-	else if (bits != val)
-		lsb = 0;
-	else
-		lsb = extract_bits(range->lo, lo-1, 0);
-	if (hi == 31)
-		msb = 0;
-	else
-		msb = (range->lo >> (hi+1)) << lo;
-	range->lo = msb + lsb;
+	eq = -(uint64_t) (bits == val);
+	msb = ((uint64_t) range->lo >> (hi+1)) + (bits > val);
+	lsb = range->lo & lsb_mask & eq;
+	new_lo = msb * (int64_t) (lsb_mask + 1) + lsb;
 
 	// compute range.hi
 	bits = extract_bits(range->hi, hi, lo);
-	if (bits < val) {
-		if (hi == 31)
-			return 0;	// no overlap with the cut space
-		if ((range->hi >> (hi+1)) == 0)
-			return 0;	// underflow, no overlap
-		range->hi = range->hi - (1 <<(hi+1));
+	eq = -(uint64_t) (bits == val);
+	msb = (int64_t) ((uint64_t) range->hi >> (hi+1)) - (bits < val);
+	lsb = (range->hi & lsb_mask & eq) | (lsb_mask & ~eq);
+	new_hi = msb * (int64_t) (lsb_mask + 1) + lsb;
+
+	range->lo = (uint32_t) new_lo;
+	range->hi = (uint32_t) new_hi;
+	return new_lo <= new_hi;
+}
+
+
+
+// fill the band summary of tbits from its mask
+void tbits_bands(TBits *tbits)
+{
+	int			bid;
+	uint32_t	m;
+
+	tbits->nbands = 0;
+	tbits->band_lo = MAX_BANDS;
+	tbits->band_hi = 0;
+	for (bid = 0; bid < MAX_BANDS; bid++) {
+		m = bid < field_bands[tbits->dim] ? extract_bits(tbits->mask, band_msb(bid), band_lsb(bid)) : 0;
+		tbits->bandmap[bid] = m != 0;
+		if (m == 0)
+			continue;
+		tbits->nbands++;
+		if (bid < tbits->band_lo)
+			tbits->band_lo = bid;
+		tbits->band_hi = bid;
+	}
+}
+
+
+
+// prefix val/plen of a field in ternary form, plen is counted from the MSB of the field
+void prefix_tbits(TBits *tbits, int dim, uint32_t val, int plen)
+{
+	int			width = field_bands[dim] * BAND_BITS;
+	uint64_t	field_mask = (1ULL << width) - 1;
+
+	tbits->dim = dim;
+	tbits->mask = (uint32_t) (field_mask & ~((1ULL << (width - plen)) - 1));
+	tbits->val = val & tbits->mask;
+	tbits_bands(tbits);
+}
+
+
+
+// decompose a range into the minimal set of prefixes, return the number of TBits filled
+// (at most MAX_RANGE_TBITS); a prefix range gives exactly one TBits
+int range_tbits(TBits *tbits, int dim, Range range)
+{
+	int			width = field_bands[dim] * BAND_BITS, k, n = 0;
+	uint64_t	lo = range.lo, hi = range.hi;
+
+	while (lo <= hi) {
+		// largest aligned block starting at lo which fits in the range
+		k = lo == 0 ? width : __builtin_ctzll(lo);
+		while (lo + (1ULL << k) - 1 > hi)
+			k--;
+		prefix_tbits(&tbits[n++], dim, (uint32_t) lo, width - k);
+		lo += 1ULL << k;
+	}
+	return n;
+}
+
+
+
+// check whether some value of the range matches the ternary bits: find the smallest
+// value >= range.lo matching tbits, then compare it with range.hi
+int range_tbits_overlap(Range *range, TBits *tbits)
+{
+	int			width = field_bands[tbits->dim] * BAND_BITS, b, p;
+	uint64_t	field_mask = (1ULL << width) - 1;
+	uint64_t	lo = range->lo, m = tbits->mask, v = tbits->val;
+	uint64_t	diff, above, free0, x;
+
+	diff = (lo ^ v) & m;
+	if (diff == 0)
+		return range->lo <= range->hi;	// range.lo itself matches
+
+	b = 63 - __builtin_clzll(diff);		// highest specified bit where range.lo disagrees
+	above = ~((2ULL << b) - 1);
+	if ((v >> b) & 1) {
+		// keep the higher bits of range.lo, the lower * bits all go 0
+		x = (lo & above) | (v & ~above);
+	} else {
+		// carry into the lowest * bit above b which is 0 in range.lo
+		free0 = ~m & ~lo & above & field_mask;
+		if (free0 == 0)
+			return 0;
+		p = __builtin_ctzll(free0);
+		above = ~((2ULL << p) - 1);
+		x = (lo & above) | (1ULL << p) | (v & ((1ULL << p) - 1));
+	}
+	return x <= range->hi;
+}
+
+
+
+// check whether a band is a * band in tbits
+inline
+int free_band(TBits *tbits, int curr_band)
+{
+	return tbits->bandmap[curr_band] == 0;
+}
+
+
+
+// the smallest range containing all values of tbits (exact for prefixes)
+inline
+Range tbits_range(TBits *tbits)
+{
+	int			width = field_bands[tbits->dim] * BAND_BITS;
+	uint32_t	field_mask = (uint32_t) ((1ULL << width) - 1);
+	Range		r;
+
+	r.lo = tbits->val & tbits->mask;
+	r.hi = tbits->val | (~tbits->mask & field_mask);
+	return r;
+}
+
+
+
+inline
+int tbits_match(TBits *tbits, uint32_t a)
+{
+	return (a & tbits->mask) == tbits->val;
+}
+
+
+
+// convert rules into ternary form once, all TBits are kept in one pool
+BandRule* band_rules_new(Rule *rules, int nrules)
+{
+	BandRule	*brules;
+	TBits		*pool, tbits[MAX_RANGE_TBITS];
+	int			i, dim, n, ntbits = 0;
+
+	brules = malloc(nrules * sizeof(BandRule));
+	for (i = 0; i < nrules; i++) {
+		for (dim = 0; dim < NFIELDS; dim++) {
+			n = range_tbits(tbits, dim, rules[i].field[dim]);
+			brules[i].ntbits[dim] = n;
+			ntbits += n;
+		}
+	}
+
+	pool = malloc(ntbits * sizeof(TBits));
+	for (i = 0; i < nrules; i++) {
+		brules[i].rule = &rules[i];
+		for (dim = 0; dim < NFIELDS; dim++) {
+			brules[i].tbits[dim] = pool;
+			pool += range_tbits(pool, dim, rules[i].field[dim]);
+		}
+	}
+	return brules;
+}
+
+
+
+void band_rules_free(BandRule *brules, int nrules)
+{
+	if (nrules > 0)
+		free(brules[0].tbits[0]);
+	free(brules);
+}
+
+
+
+// bytes of the rules in ternary form with their TBits
+size_t band_rules_bytes(BandRule *brules, int nrules)
+{
+	size_t	ntbits = 0;
+	int		i, dim;
+
+	for (i = 0; i < nrules; i++) {
+		for (dim = 0; dim < NFIELDS; dim++)
+			ntbits += brules[i].ntbits[dim];
+	}
+	return nrules * sizeof(BandRule) + ntbits * sizeof(TBits);
+}
+
+
+
+// copy the rules in ternary form into mem of band_rules_bytes(), return the copy
+BandRule* band_rules_clone(BandRule *brules, int nrules, void *mem)
+{
+	BandRule	*copy = mem;
+	TBits		*pool = (TBits *) (copy + nrules);
+	int			i, dim;
+
+	memcpy(copy, brules, nrules * sizeof(BandRule));
+	if (nrules > 0)
+		memcpy(pool, brules[0].tbits[0], band_rules_bytes(brules, nrules) - nrules * sizeof(BandRule));
+	for (i = 0; i < nrules; i++) {
+		for (dim = 0; dim < NFIELDS; dim++)
+			copy[i].tbits[dim] = pool + (brules[i].tbits[dim] - brules[0].tbits[0]);
+	}
+	return copy;
+}
+
+
+
+// masked compares of a packet against the ternary form of a rule
+int band_rule_match(BandRule *brule, Packet *pkt)
+{
+	int		dim, k;
+	TBits	*tbits;
+
+	for (dim = 0; dim < NFIELDS; dim++) {
+		tbits = brule->tbits[dim];
+		for (k = 0; k < brule->ntbits[dim]; k++) {
+			if (tbits_match(&tbits[k], pkt->field[dim]))
+				break;
+		}
+		if (k == brule->ntbits[dim])
+			return 0;
+	}
+	return 1;
+}
+
+
+
+void dump_tbits(TBits *tb)
+{
+	int		b, width = field_bands[tb->dim] * BAND_BITS;
+
+	printf("d%d ", tb->dim);
+	for (b = width - 1; b >= 0; b--) {
+		if (((tb->mask >> b) & 1) == 0)
+			printf("*");
+		else
+			printf("%d", (tb->val >> b) & 1);
+		if (b > 0 && b % BAND_BITS == 0)
+			printf(" ");
 	}
-	if (lo == 0)
-		lsb = 0;
-	else if (bits != val)
-		lsb = (1 << lo) - 1;
-	else
-		lsb = extract_bits(range->hi, lo-1, 0);
-	if (hi == 31)
-		msb = 0;
-	else
-		msb = (range->hi >> (hi+1)) << lo;
-	range->hi =  msb + lsb;
-
-	if (range->lo > range->hi)
-		return 0;
-	else
-		return 1;
+	printf("\n");
 }
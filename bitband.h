@@ -12,6 +12,8 @@
 #define	TOTAL_BANDS	26	// sum of bit-bands of a rule (sip + dip + sp + ...)
 #define CUT_BANDS	2	// #bands at each tree node to partition the space
 
+#define MAX_RANGE_TBITS	(2*BITS - 2)	// max #prefixes a range decomposes into
+
 extern int field_bands[NFIELDS];
 
 
@@ -31,9 +33,31 @@ typedef struct {
 	uint8_t		band_hi;	// highest non-* band (0 when non-existant)
 	uint8_t		bandmap[MAX_BANDS];	// 0 for * bands; 1 for others; band_map[0] for LSB
 	uint32_t	val;		// bit values
+	uint32_t	mask;		// 1 for specified bits, 0 for * bits
 } TBits;
 
 
+// a rule converted to ternary form, a port range is a set of TBits (one per prefix)
+typedef struct {
+	Rule		*rule;
+	uint8_t		ntbits[NFIELDS];
+	TBits		*tbits[NFIELDS];
+} BandRule;
+
+
+inline
+int band_lsb(int band_id);
+
+inline
+int band_msb(int band_id);
+
+inline
+uint32_t band_strip(uint32_t a, int bid);
+
+int range_strip(Range *range, int bid, uint32_t val);
+
+void prefix_tbits(TBits *tbits, int dim, uint32_t val, int plen);
+int range_tbits(TBits *tbits, int dim, Range range);
 
 int range_tbits_overlap(Range *range, TBits *tbits);
 
@@ -43,6 +67,15 @@ int free_band(TBits *tbits, int curr_band);
 inline
 Range tbits_range(TBits *tbits);
 
+inline
+int tbits_match(TBits *tbits, uint32_t a);
+
+BandRule* band_rules_new(Rule *rules, int nrules);
+void band_rules_free(BandRule *brules, int nrules);
+size_t band_rules_bytes(BandRule *brules, int nrules);
+BandRule* band_rules_clone(BandRule *brules, int nrules, void *mem);
+int band_rule_match(BandRule *brule, Packet *pkt);
+
 void dump_tbits(TBits *tb);
 
 #endif
@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "classifier.h"
+
+
+
+// replicate the trie on each NUMA node and give each core the replica of its node; the
+// handle does not change after this and does not depend on the built trie any more
+Classifier* classifier_new(Trie *root, int order, int top_levels, int huge)
+{
+	Classifier	*c;
+	int			i, k;
+
+	c = calloc(1, sizeof(Classifier));
+	c->nimages = image_replicate(c->images, root, order, top_levels, huge);
+	if (c->nimages == 0) {
+		free(c);
+		return NULL;
+	}
+	c->ncores = sysconf(_SC_NPROCESSORS_CONF);
+	if (c->ncores > MAX_CPUS)
+		c->ncores = MAX_CPUS;
+	c->core_image = malloc(c->ncores * sizeof(Image *));
+	c->stats = aligned_alloc(CACHE_LINE, c->ncores * sizeof(CoreStats));
+	memset(c->stats, 0, c->ncores * sizeof(CoreStats));
+	c->gen = __atomic_load_n(&trie_generation, __ATOMIC_ACQUIRE);
+
+	for (i = 0; i < c->ncores; i++) {
+		c->core_image[i] = &c->images[0];
+		for (k = 0; k < c->nimages; k++) {
+			if (c->images[k].node == cpu_node(i))
+				c->core_image[i] = &c->images[k];
+		}
+	}
+	return c;
+}
+
+
+
+void classifier_free(Classifier *c)
+{
+	int		i;
+
+	for (i = 0; i < c->nimages; i++)
+		arena_free(c->images[i].arena);
+	if (c->flows != NULL) {
+		for (i = 0; i < c->ncores; i++) {
+			if (c->flows[i] != NULL)
+				flow_cache_free(c->flows[i]);
+		}
+		free(c->flows);
+	}
+	free(c->core_image);
+	free(c->stats);
+	free(c);
+}
+
+
+
+// give each core a flow cache of entries keys in front of the trie walk; made by the core's
+// first lookup so it is on the core's NUMA node
+void classifier_flow_cache(Classifier *c, int entries)
+{
+	c->flows = calloc(c->ncores, sizeof(FlowCache *));
+	c->flow_entries = entries;
+}
+
+
+
+// classify on the image local to core; core is the cpu the caller is pinned to
+inline Rule* classifier_lookup(Classifier *c, int core, Packet *pkt)
+{
+	Image		*img = c->core_image[core];
+	CoreStats	*s = &c->stats[core];
+	FlowCache	*fc = NULL;
+	FlowKey		key;
+	Trie		*end;
+	Rule		*r;
+
+	s->lookups++;
+	if (c->flows != NULL) {
+		if ((fc = c->flows[core]) == NULL)
+			fc = c->flows[core] = flow_cache_new(c->flow_entries);
+		flow_key(pkt, &key);
+		if (flow_probe(fc, &key, c->gen, &r)) {
+			s->flow_hits++;
+			return r;
+		}
+	}
+	r = descend(img->root, img->brules, &img->pool, pkt, &end);
+	if (fc != NULL)
+		flow_insert(fc, &key, c->gen, r);
+	if (r == NULL)
+		s->misses++;
+	else if (end->nchildren > 0 || r == end->full_cover)
+		s->cover_hits++;
+	else
+		s->leaf_hits++;
+	return r;
+}
+
+
+
+// sum the counters of all cores; the owners may still be counting
+void classifier_stats(Classifier *c, CoreStats *sum)
+{
+	int		i;
+
+	memset(sum, 0, sizeof(CoreStats));
+	for (i = 0; i < c->ncores; i++) {
+		sum->lookups += __atomic_load_n(&c->stats[i].lookups, __ATOMIC_RELAXED);
+		sum->leaf_hits += __atomic_load_n(&c->stats[i].leaf_hits, __ATOMIC_RELAXED);
+		sum->cover_hits += __atomic_load_n(&c->stats[i].cover_hits, __ATOMIC_RELAXED);
+		sum->misses += __atomic_load_n(&c->stats[i].misses, __ATOMIC_RELAXED);
+		sum->flow_hits += __atomic_load_n(&c->stats[i].flow_hits, __ATOMIC_RELAXED);
+	}
+}
+
+
+
+// zero the counters and empty the flow caches; no lookups may run meanwhile
+void classifier_reset(Classifier *c)
+{
+	int		i;
+
+	memset(c->stats, 0, c->ncores * sizeof(CoreStats));
+	for (i = 0; c->flows != NULL && i < c->ncores; i++) {
+		if (c->flows[i] != NULL)
+			flow_cache_reset(c->flows[i]);
+	}
+}
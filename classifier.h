@@ -0,0 +1,40 @@
+#ifndef CLASSIFIER_H
+#define CLASSIFIER_H
+
+#include "trie.h"
+#include "numa.h"
+#include "flowcache.h"
+
+
+// lookup counters of one core, alone on their cache line
+typedef struct {
+	uint64_t	lookups;
+	uint64_t	leaf_hits;		// decided by the rules of a leaf
+	uint64_t	cover_hits;		// decided by the full cover of a node
+	uint64_t	misses;			// no rule matched
+	uint64_t	flow_hits;		// found in the flow cache, no walk
+} __attribute__((aligned(CACHE_LINE))) CoreStats;
+
+
+// classifier handle: read-only replicas of the trie made at build, shared by the workers;
+// a lookup only reads the image of its core and writes the counters of its core
+typedef struct {
+	Image		images[MAX_NUMA_NODES];
+	int			nimages;
+	int			ncores;
+	Image		**core_image;	// local image of each core
+	CoreStats	*stats;			// per core
+	FlowCache	**flows;		// per core, NULL without flow caches
+	int			flow_entries;
+	uint32_t	gen;			// generation of the images, what the flow caches hold
+} Classifier;
+
+
+Classifier* classifier_new(Trie *root, int order, int top_levels, int huge);
+void classifier_free(Classifier *c);
+void classifier_flow_cache(Classifier *c, int entries);
+Rule* classifier_lookup(Classifier *c, int core, Packet *pkt);
+void classifier_stats(Classifier *c, CoreStats *sum);
+void classifier_reset(Classifier *c);
+
+#endif
@@ -33,6 +33,35 @@ Range range_sect(Range a, Range b)
 
 
 
+// #leading bits of the longest prefix containing a range
+inline
+int range_hull(Range r)
+{
+	return r.lo == r.hi ? 32 : __builtin_clz(r.lo ^ r.hi);
+}
+
+
+
+inline
+uint32_t prefix_mask(int bits)
+{
+	return bits == 0 ? 0 : ~0U << (32 - bits);
+}
+
+
+
+// hash of a pair of prefixes (value, #bits)
+inline
+uint32_t hull_hash(uint32_t val0, int bits0, uint32_t val1, int bits1)
+{
+	uint64_t	h = ((uint64_t) val0 << 32 | val1) ^ ((uint64_t) bits0 << 6 | bits1);
+
+	h *= 0x9e3779b97f4a7c15UL;
+	return h >> 32;
+}
+
+
+
 inline
 uint32_t extract_bits(uint32_t a, int hi, int lo)
 {
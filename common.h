@@ -16,9 +16,21 @@ typedef struct {
 inline
 int range_overlap(Range a, Range b);
 
+inline
+int range_cover(Range a, Range b);
+
 inline
 Range range_sect(Range a, Range b);
 
+inline
+int range_hull(Range r);
+
+inline
+uint32_t prefix_mask(int bits);
+
+inline
+uint32_t hull_hash(uint32_t val0, int bits0, uint32_t val1, int bits1);
+
 
 // bit operations for 8/16/32-bit unsigned integers
 inline
@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "flowcache.h"
+
+
+
+// a cache of at least entries keys, in a power of two sets
+FlowCache* flow_cache_new(int entries)
+{
+	FlowCache	*fc;
+	uint32_t	nsets = 1;
+
+	while (nsets * FLOW_WAYS < entries)
+		nsets <<= 1;
+	fc = calloc(1, sizeof(FlowCache));
+	fc->sets = aligned_alloc(CACHE_LINE, nsets * sizeof(FlowSet));
+	fc->mask = nsets - 1;
+	flow_cache_reset(fc);
+	return fc;
+}
+
+
+
+void flow_cache_free(FlowCache *fc)
+{
+	free(fc->sets);
+	free(fc);
+}
+
+
+
+void flow_cache_reset(FlowCache *fc)
+{
+	memset(fc->sets, 0, (fc->mask + 1) * sizeof(FlowSet));
+	fc->hits = fc->misses = fc->stale = 0;
+}
+
+
+
+inline void flow_key(Packet *pkt, FlowKey *key)
+{
+	key->word[0] = pkt->field[0];
+	key->word[1] = pkt->field[1];
+	key->word[2] = pkt->field[2] << 16 | pkt->field[3];
+	key->word[3] = pkt->field[4];
+}
+
+
+
+inline uint32_t flow_hash(FlowKey *key)
+{
+	uint32_t	h;
+
+	h = key->word[0] * 0x9E3779B1 ^ key->word[1] * 0x85EBCA77
+		^ key->word[2] * 0xC2B2AE3D ^ key->word[3] * 0x27D4EB2F;
+	return h ^ h >> 15;
+}
+
+
+
+// bit of each way of the set holding key
+inline int flow_match(FlowSet *s, FlowKey *key)
+{
+	int		way, hit = 0;
+#ifdef __SSE2__
+	__m128i	k = _mm_loadu_si128((__m128i *) key);
+
+	for (way = 0; way < FLOW_WAYS; way++) {
+		__m128i	eq = _mm_cmpeq_epi32(k, _mm_load_si128((__m128i *) &s->key[way]));
+		hit |= (_mm_movemask_epi8(eq) == 0xFFFF) << way;
+	}
+#else
+	for (way = 0; way < FLOW_WAYS; way++)
+		hit |= (memcmp(key, &s->key[way], sizeof(FlowKey)) == 0) << way;
+#endif
+	return hit & s->valid;
+}
+
+
+
+// the rule cached for key at generation gen; 0 on a miss
+inline int flow_probe(FlowCache *fc, FlowKey *key, uint32_t gen, Rule **rule)
+{
+	FlowSet	*s = &fc->sets[flow_hash(key) & fc->mask];
+	int		hit;
+
+	if (s->gen != gen) {
+		fc->stale += s->valid != 0;
+		fc->misses++;
+		return 0;
+	}
+	hit = flow_match(s, key);
+	if (hit == 0) {
+		fc->misses++;
+		return 0;
+	}
+	fc->hits++;
+	*rule = s->rule[__builtin_ctz(hit)];
+	return 1;
+}
+
+
+
+// cache the rule of key (NULL for no match); a set of an older generation is emptied first
+inline void flow_insert(FlowCache *fc, FlowKey *key, uint32_t gen, Rule *rule)
+{
+	FlowSet	*s = &fc->sets[flow_hash(key) & fc->mask];
+	int		way;
+
+	if (s->gen != gen) {
+		s->gen = gen;
+		s->valid = 0;
+	}
+	if (s->valid != (1 << FLOW_WAYS) - 1) {
+		way = __builtin_ctz(~s->valid);
+	} else {
+		way = s->victim;
+		s->victim = (way + 1) % FLOW_WAYS;
+	}
+	s->key[way] = *key;
+	s->rule[way] = rule;
+	s->valid |= 1 << way;
+}
+
+
+
+// classify through the cache; gen is the generation of root, read before the walk so a
+// result of a trie swapped meanwhile is not kept
+inline Rule* flow_lookup(FlowCache *fc, Trie *root, BandRule *brules, LeafPool *pool, Packet *pkt,
+		uint32_t gen)
+{
+	FlowKey	key;
+	Rule	*r;
+
+	flow_key(pkt, &key);
+	if (flow_probe(fc, &key, gen, &r))
+		return r;
+	r = lookup(root, brules, pool, pkt);
+	flow_insert(fc, &key, gen, r);
+	return r;
+}
+
+
+
+void flow_report(FlowCache *fc, char *label)
+{
+	uint64_t	n = fc->hits + fc->misses;
+
+	printf("%s: %u sets x %d ways, %lu lookups, %.2f%% hits, %lu stale sets\n", label,
+			fc->mask + 1, FLOW_WAYS, n, n > 0 ? 100.0 * fc->hits / n : 0.0, fc->stale);
+}
@@ -0,0 +1,49 @@
+#ifndef FLOWCACHE_H
+#define FLOWCACHE_H
+
+#include "trie.h"
+
+#define CACHE_LINE	64
+#define FLOW_WAYS	4		// keys of a set, compared together
+
+
+// packed 5-tuple: src ip, dst ip, src port << 16 | dst port, protocol
+typedef struct {
+	uint32_t	word[4];
+} FlowKey;
+
+// keys on the first cache line, what they map to on the second; a set filled at an older
+// trie generation holds nothing
+typedef struct {
+	FlowKey		key[FLOW_WAYS];
+	Rule		*rule[FLOW_WAYS];
+	uint32_t	gen;
+	uint8_t		valid;			// bit of each way in use
+	uint8_t		victim;			// next way replaced when all are in use
+} __attribute__((aligned(CACHE_LINE))) FlowSet;
+
+// exact-match cache of the lookup results of one thread, never shared
+typedef struct {
+	FlowSet		*sets;
+	uint32_t	mask;			// #sets - 1
+	uint64_t	hits;
+	uint64_t	misses;
+	uint64_t	stale;			// misses on a set of an older generation
+} FlowCache;
+
+
+FlowCache* flow_cache_new(int entries);
+void flow_cache_free(FlowCache *fc);
+void flow_cache_reset(FlowCache *fc);
+inline
+void flow_key(Packet *pkt, FlowKey *key);
+inline
+int flow_probe(FlowCache *fc, FlowKey *key, uint32_t gen, Rule **rule);
+inline
+void flow_insert(FlowCache *fc, FlowKey *key, uint32_t gen, Rule *rule);
+inline
+Rule* flow_lookup(FlowCache *fc, Trie *root, BandRule *brules, LeafPool *pool, Packet *pkt,
+		uint32_t gen);
+void flow_report(FlowCache *fc, char *label);
+
+#endif
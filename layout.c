@@ -0,0 +1,564 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include "layout.h"
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT	26
+#endif
+
+#define REPORT_PAGES	64		// #pages sampled for the NUMA placement report
+
+
+char		*page_names[] = {"4KB", "THP", "2MB hugetlb", "1GB hugetlb"};
+
+Arena		*arenas;			// arenas with some array still in use
+int			layout_copy;		// copy instead of move: arrays are not retired
+LeafPool	*layout_pool;		// of the copy, the packed leaves point into it
+size_t		top_block_bytes;	// of the last layout
+int			num_subtrees;
+
+// memory replaced by layouts but maybe still read by concurrent lookups
+typedef struct {
+	void		*ptr;
+	Arena		*arena;			// NULL for heap memory
+} Retired;
+
+Retired		*retired;
+int			num_retired, retired_size;
+
+
+
+/******************************************************************************
+ *
+ * Section for arena and retired memory management
+ *
+ *****************************************************************************/
+
+void* map_huge(Arena *a, size_t size, size_t page_size, int pages)
+{
+	int		shift = __builtin_ctzl(page_size);
+
+	a->size = (size + page_size - 1) & ~(page_size - 1);
+	a->pages = pages;
+	return mmap(NULL, a->size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (shift << MAP_HUGE_SHIFT), -1, 0);
+}
+
+
+
+// map an arena of at least size bytes, backed by the huge pages asked for if available, else
+// by smaller huge pages, THP or normal pages in turn
+Arena* arena_new(size_t size, int huge)
+{
+	Arena	*a = calloc(1, sizeof(Arena));
+	void	*p = MAP_FAILED;
+
+	if (huge == HUGE_1GB)
+		p = map_huge(a, size, GIANT_PAGE_SIZE, PAGES_HUGETLB_1G);
+	if (p == MAP_FAILED && huge != HUGE_NONE)
+		p = map_huge(a, size, HUGE_PAGE_SIZE, PAGES_HUGETLB);
+	if (p == MAP_FAILED) {
+		a->size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+		p = mmap(NULL, a->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		a->pages = PAGES_NORMAL;
+		if (p != MAP_FAILED && huge != HUGE_NONE && madvise(p, a->size, MADV_HUGEPAGE) == 0)
+			a->pages = PAGES_THP;
+	}
+	if (p == MAP_FAILED) {
+		free(a);
+		return NULL;
+	}
+
+	a->base = p;
+	a->next = arenas;
+	arenas = a;
+	return a;
+}
+
+
+
+// bind the (untouched) pages of an arena to a NUMA node, return 0 on failure
+int arena_bind(Arena *a, int node)
+{
+	unsigned long	mask[16] = {0};
+
+	if (node < 0 || node >= 16 * 64)
+		return 0;
+	mask[node / 64] = 1UL << (node % 64);
+	return syscall(SYS_mbind, a->base, a->size, MPOL_BIND, mask, 16 * 64, 0) == 0;
+}
+
+
+
+// kB of transparent huge pages backing the arena, from /proc/self/smaps
+long arena_thp_kb(Arena *a)
+{
+	FILE			*fp;
+	char			line[256];
+	unsigned long	lo, hi;
+	long			kb = 0, n;
+	int				in = 0;
+
+	if ((fp = fopen("/proc/self/smaps", "r")) == NULL)
+		return -1;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "%lx-%lx ", &lo, &hi) == 2)
+			in = (char *) lo < a->base + a->size && (char *) hi > a->base;
+		else if (in && sscanf(line, "AnonHugePages: %ld kB", &n) == 1)
+			kb += n;
+	}
+	fclose(fp);
+	return kb;
+}
+
+
+
+// report the pages achieved, and the NUMA nodes of sampled pages
+void arena_report(Arena *a)
+{
+	void	*pages[REPORT_PAGES];
+	int		status[REPORT_PAGES], nodes[REPORT_PAGES], npages, i, k, n = 0;
+	size_t	step;
+
+	printf("%.1f MB, %s pages", a->used / 1048576.0, page_names[a->pages]);
+	if (a->pages == PAGES_THP)
+		printf(" (%ld kB THP)", arena_thp_kb(a));
+
+	npages = (a->used + PAGE_SIZE - 1) / PAGE_SIZE;
+	npages = npages < REPORT_PAGES ? npages : REPORT_PAGES;
+	step = npages > 0 ? ((a->used / npages) & ~(PAGE_SIZE - 1)) : 0;
+	for (i = 0; i < npages; i++)
+		pages[i] = a->base + i * step;
+	if (npages == 0 || syscall(SYS_move_pages, 0, npages, pages, NULL, status, 0) != 0) {
+		printf(", NUMA node n/a\n");
+		return;
+	}
+
+	// count sampled pages per node
+	for (i = 0; i < npages; i++) {
+		for (k = 0; k < n && nodes[k] != status[i]; k++)
+			;
+		if (k == n)
+			nodes[n++] = status[i];
+	}
+	for (k = 0; k < n; k++) {
+		for (i = 0, step = 0; i < npages; i++)
+			step += status[i] == nodes[k];
+		if (nodes[k] >= 0)
+			printf(", node %d: %lu/%d pages", nodes[k], step, npages);
+		else
+			printf(", not placed: %lu/%d pages", step, npages);
+	}
+	printf("\n");
+}
+
+
+
+// 8-byte aligned, no arena overflow check: layouts size their arenas beforehand
+void* arena_alloc(Arena *a, size_t bytes)
+{
+	void	*p = a->base + a->used;
+
+	a->used += (bytes + 7) & ~7UL;
+	a->live += (bytes + 7) & ~7UL;
+	return p;
+}
+
+
+
+// arena_alloc() at a multiple of align, a power of 2
+void* arena_alloc_aligned(Arena *a, size_t bytes, size_t align)
+{
+	a->used = (a->used + align - 1) & ~(align - 1);
+	return arena_alloc(a, bytes);
+}
+
+
+
+int arena_contains(Arena *a, void *p)
+{
+	return a != NULL && (char *) p >= a->base && (char *) p < a->base + a->used;
+}
+
+
+
+// give back the unused tail of an arena with normal pages
+void arena_trim(Arena *a)
+{
+	size_t	size = (a->used + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+	if (a->pages == PAGES_HUGETLB || size >= a->size)
+		return;
+	munmap(a->base + size, a->size - size);
+	a->size = size;
+}
+
+
+
+// unmap an arena no lookup uses any more
+void arena_free(Arena *a)
+{
+	Arena	**p;
+
+	for (p = &arenas; *p != NULL; p = &(*p)->next) {
+		if (*p == a) {
+			*p = a->next;
+			break;
+		}
+	}
+	munmap(a->base, a->size);
+	free(a);
+}
+
+
+
+void retire(void *ptr, Arena *a)
+{
+	if (num_retired >= retired_size) {
+		retired_size = retired_size == 0 ? 64 : retired_size * 2;
+		retired = realloc(retired, retired_size * sizeof(Retired));
+	}
+	retired[num_retired].ptr = ptr;
+	retired[num_retired].arena = a;
+	num_retired++;
+}
+
+
+
+// free the memory replaced by layouts, only when no lookup can still be reading it
+void layout_reclaim()
+{
+	int		i;
+
+	for (i = 0; i < num_retired; i++) {
+		if (retired[i].arena == NULL) {
+			free(retired[i].ptr);
+		} else {
+			munmap(retired[i].arena->base, retired[i].arena->size);
+			free(retired[i].arena);
+		}
+	}
+	num_retired = 0;
+}
+
+
+
+// copy bytes at old into arena a (heap when NULL), the old copy is retired; an arena is
+// retired as a whole when its last array moves out
+void* layout_move(void *old, size_t bytes, Arena *a)
+{
+	Arena	**p, *b;
+	void	*new;
+
+	new = a != NULL ? arena_alloc(a, bytes) : malloc(bytes);
+	memcpy(new, old, bytes);
+	if (layout_copy)
+		return new;
+
+	for (p = &arenas; *p != NULL; p = &(*p)->next) {
+		b = *p;
+		if (arena_contains(b, old))
+			break;
+	}
+	if (*p == NULL) {
+		retire(old, NULL);
+	} else if ((b->live -= (bytes + 7) & ~7UL) == 0) {
+		*p = b->next;
+		retire(NULL, b);
+	}
+	return new;
+}
+
+
+
+// the id list p of the built pool in the pool of the copy
+void* rebase_ids(void *p)
+{
+	return layout_pool != NULL ? (char *) layout_pool->ids + ((char *) p - (char *) leaf_pool.ids) : p;
+}
+
+
+
+// move the rule list of leaf u into arena a (heap when NULL), or its LeafBounds, with the id
+// lists of a copy in the pool of the copy
+void place_leaf(Trie *u, Arena *a)
+{
+	LeafBounds	*lb;
+	size_t		bytes;
+
+	if (u->nchildren > 0)
+		return;
+	if (u->rules != NULL)
+		u->rules = layout_move(u->rules, u->nrules * sizeof(Rule *), a);
+	if (u->ids != NULL && leaf_pool.narrow) {
+		lb = u->ids;
+		bytes = sizeof(LeafBounds) + lb->nblocks * lb->block_bytes;
+		if (a != NULL)
+			a->used = (a->used + 15) & ~15UL;
+		lb = layout_move(lb, bytes, a);
+		lb->ids = rebase_ids(lb->ids);
+		u->ids = lb;
+	} else if (u->ids != NULL) {
+		u->ids = rebase_ids(u->ids);
+	}
+}
+
+
+
+// bytes place_leaf() takes for u
+size_t leaf_bytes(Trie *u)
+{
+	LeafBounds	*lb = u->ids;
+	size_t		bytes = 0;
+
+	if (u->nchildren > 0)
+		return 0;
+	if (u->rules != NULL)
+		bytes += (u->nrules * sizeof(Rule *) + 7) & ~7UL;
+	if (u->ids != NULL && leaf_pool.narrow)
+		bytes += 16 + ((sizeof(LeafBounds) + lb->nblocks * lb->block_bytes + 7) & ~7UL);
+	return bytes;
+}
+
+
+
+// move the children array of v into arena a (heap when NULL), the rule lists of leaf children
+// and the points and cover lists of the children follow the array; concurrent lookups see either the old
+// or the new array. When copying, v is already a copy and the children get their parent here
+Trie* place_children(Trie *v, Arena *a)
+{
+	Trie	*children, *u;
+	int		i;
+
+	if (v->nchildren == 0)
+		return NULL;
+
+	children = layout_move(v->children, v->nchildren * sizeof(Trie), a);
+	for (i = 0; i < v->nchildren; i++) {
+		u = &children[i];
+		place_leaf(u, a);
+		if (u->points != NULL)
+			u->points = layout_move(u->points, POINTS_BYTES, a);
+		if (u->ncovers > 0)
+			u->covers = layout_move(u->covers, u->ncovers * sizeof(Rule *), a);
+	}
+	__atomic_store_n(&v->children, children, __ATOMIC_RELEASE);
+	if (layout_copy) {
+		for (i = 0; i < v->nchildren; i++)
+			children[i].parent = v;
+	} else {
+		relink_children(v);
+	}
+	return children;
+}
+
+
+
+/******************************************************************************
+ *
+ * Section for BFS and van Emde Boas layouts
+ *
+ *****************************************************************************/
+
+// bytes place_children() takes for v
+size_t children_bytes(Trie *v)
+{
+	size_t	bytes = v->nchildren * sizeof(Trie);
+	int		i;
+
+	for (i = 0; i < v->nchildren; i++) {
+		bytes += leaf_bytes(&v->children[i]);
+		if (v->children[i].points != NULL)
+			bytes += (POINTS_BYTES + 7) & ~7UL;
+		bytes += (v->children[i].ncovers * sizeof(Rule *) + 7) & ~7UL;
+	}
+	return bytes;
+}
+
+
+
+size_t subtree_bytes(Trie *v)
+{
+	size_t	bytes = children_bytes(v);
+	int		i;
+
+	for (i = 0; i < v->nchildren; i++)
+		bytes += subtree_bytes(&v->children[i]);
+	return bytes;
+}
+
+
+
+// #levels of nodes with children in the subtree of v
+int subtree_height(Trie *v)
+{
+	int		h = 0, i, k;
+
+	for (i = 0; i < v->nchildren; i++) {
+		k = subtree_height(&v->children[i]);
+		h = k > h ? k : h;
+	}
+	return v->nchildren > 0 ? h + 1 : 0;
+}
+
+
+
+// place the arrays of the nodes within levels below v level by level
+void place_bfs(Trie *v, int levels, Arena *a, Trie **queue)
+{
+	Trie	*u, *children;
+	int		head = 0, tail = 0, i;
+
+	queue[tail++] = v;
+	while (head < tail) {
+		u = queue[head++];
+		if (u->depth - v->depth >= levels || (children = place_children(u, a)) == NULL)
+			continue;
+		for (i = 0; i < u->nchildren; i++)
+			queue[tail++] = &children[i];
+	}
+}
+
+
+
+void place_veb(Trie *v, int levels, Arena *a);
+
+// place the vEB subtrees rooted at nodes depth levels below v
+void place_veb_bottom(Trie *v, int depth, int levels, Arena *a)
+{
+	int		i;
+
+	if (v->depth == depth) {
+		place_veb(v, levels, a);
+		return;
+	}
+	for (i = 0; i < v->nchildren; i++)
+		place_veb_bottom(&v->children[i], depth, levels, a);
+}
+
+
+
+// van Emde Boas order: the top half of the levels, then each subtree of the bottom half
+void place_veb(Trie *v, int levels, Arena *a)
+{
+	int		top;
+
+	if (levels <= 0 || v->nchildren == 0)
+		return;
+	if (levels == 1) {
+		place_children(v, a);
+		return;
+	}
+	top = (levels + 1) / 2;
+	place_veb(v, top, a);
+	place_veb_bottom(v, v->depth + top, levels - top, a);
+}
+
+
+
+void place_order(Trie *v, int levels, Arena *a, int order, Trie **queue)
+{
+	if (order == LAYOUT_VEB)
+		place_veb(v, levels, a);
+	else
+		place_bfs(v, levels, a, queue);
+}
+
+
+
+// bytes of a whole trie laid out, before page padding
+size_t trie_bytes(Trie *root)
+{
+	size_t	bytes = sizeof(Trie) + subtree_bytes(root) + leaf_bytes(root);
+
+	if (root->points != NULL)
+		bytes += (POINTS_BYTES + 7) & ~7UL;
+	bytes += root->ncovers * sizeof(Rule *);
+	return bytes;
+}
+
+
+
+// lay out the whole trie in arena a: the top levels form a dense block, each subtree beneath
+// follows in the same order and starts a new page when it does not fit in the rest of the
+// current one. The arrays are moved, or copied to make another image of the trie with the
+// packed leaf data in copy
+Trie* layout_into(Trie *root, Arena *a, int order, int top_levels, LeafPool *copy)
+{
+	Trie	*new_root, **queue, **subtrees, *u;
+	size_t	b;
+	int		nsub = 0, head = 0, tail = 0, i;
+
+	layout_copy = copy != NULL;
+	layout_pool = copy;
+	new_root = layout_move(root, sizeof(Trie), a);
+	place_leaf(new_root, a);
+	if (new_root->points != NULL)
+		new_root->points = layout_move(new_root->points, POINTS_BYTES, a);
+	if (new_root->ncovers > 0)
+		new_root->covers = layout_move(new_root->covers, new_root->ncovers * sizeof(Rule *), a);
+	if (!copy) {
+		trie_nodes[new_root->id] = new_root;
+		relink_children(new_root);
+	}
+
+	queue = malloc(total_nodes * sizeof(Trie *));
+	subtrees = malloc(total_nodes * sizeof(Trie *));
+	place_order(new_root, top_levels, a, order, queue);
+	top_block_bytes = a->used;
+
+	// subtree roots in level order
+	queue[tail++] = new_root;
+	while (head < tail) {
+		u = queue[head++];
+		if (u->depth - new_root->depth == top_levels) {
+			if (u->nchildren > 0)
+				subtrees[nsub++] = u;
+			continue;
+		}
+		for (i = 0; i < u->nchildren; i++)
+			queue[tail++] = &u->children[i];
+	}
+
+	for (i = 0; i < nsub; i++) {
+		b = subtree_bytes(subtrees[i]);
+		if (b > PAGE_SIZE - a->used % PAGE_SIZE)
+			a->used = (a->used + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+		place_order(subtrees[i], subtree_height(subtrees[i]), a, order, queue);
+	}
+	layout_copy = 0;
+	layout_pool = NULL;
+	num_subtrees = nsub;
+
+	free(queue);
+	free(subtrees);
+	return new_root;
+}
+
+
+
+// relayout the whole trie into one arena (see layout_into()), return the new root; the
+// replaced memory is freed by layout_reclaim()
+Trie* layout_trie(Trie *root, int order, int top_levels, int huge)
+{
+	Arena	*a;
+	Trie	*new_root;
+
+	a = arena_new(2 * trie_bytes(root) + 2 * PAGE_SIZE, huge);
+	if (a == NULL)
+		return root;
+	new_root = layout_into(root, a, order, top_levels, NULL);
+	arena_trim(a);
+	__atomic_add_fetch(&trie_generation, 1, __ATOMIC_RELEASE);
+
+	printf("layout: %s, top %d levels %lu bytes, %d subtrees %lu bytes, ",
+			order == LAYOUT_VEB ? "vEB" : "BFS", top_levels, top_block_bytes, num_subtrees,
+			a->used - top_block_bytes);
+	arena_report(a);
+	return new_root;
+}
@@ -0,0 +1,47 @@
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include <stddef.h>
+#include "trie.h"
+
+#define PAGE_SIZE		4096
+#define HUGE_PAGE_SIZE	(2UL << 20)
+#define GIANT_PAGE_SIZE	(1UL << 30)
+#define TOP_LEVELS		2		// default: levels of the top block
+
+enum { LAYOUT_BFS, LAYOUT_VEB };
+enum { HUGE_NONE, HUGE_2MB, HUGE_1GB };		// huge pages asked for
+enum { PAGES_NORMAL, PAGES_THP, PAGES_HUGETLB, PAGES_HUGETLB_1G };	// pages achieved
+
+typedef struct arena_t	Arena;
+
+// a region of node arrays (and leaf rule lists) laid out together, unmapped when nothing in
+// it is in use any more
+struct arena_t {
+	char		*base;
+	size_t		size;		// bytes mapped
+	size_t		used;		// bytes allocated
+	size_t		live;		// bytes allocated and still in use
+	int			pages;		// PAGES_*
+	Arena		*next;
+};
+
+extern char *page_names[];
+
+Arena* arena_new(size_t size, int huge);
+int arena_bind(Arena *a, int node);
+void arena_report(Arena *a);
+void* arena_alloc(Arena *a, size_t bytes);
+void* arena_alloc_aligned(Arena *a, size_t bytes, size_t align);
+int arena_contains(Arena *a, void *p);
+void arena_trim(Arena *a);
+void arena_free(Arena *a);
+size_t children_bytes(Trie *v);
+size_t trie_bytes(Trie *root);
+Trie* place_children(Trie *v, Arena *a);
+void layout_reclaim();
+
+Trie* layout_into(Trie *root, Arena *a, int order, int top_levels, LeafPool *copy);
+Trie* layout_trie(Trie *root, int order, int top_levels, int huge);
+
+#endif
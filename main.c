@@ -1,28 +1,984 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
 #include "common.h"
 #include "bitband.h"
 #include "rule.h"
 #include "trie.h"
+#include "adapt.h"
+#include "layout.h"
+#include "perfctr.h"
+#include "numa.h"
+#include "classifier.h"
+#include "pcap.h"
+#include "tenant.h"
+#include "rebuild.h"
+#include "tuple.h"
+#include "update.h"
+
+#define MAX_MATCHES		1024
 
 
 FILE		*fp = NULL;
-Rule		*ruleset = NULL;
-int			num_rules = 0;
+Rule		*ruleset = NULL, *loaded_rules = NULL;
+int			num_rules = 0, num_loaded_rules = 0;
+Packet		*trace = NULL;
+int			num_packets = 0;
+int			hot_leaf_rules = 0;
+int			layout_order = -1, top_levels = TOP_LEVELS, huge_pages = HUGE_NONE, replicate = 0;
+int			num_workers, reduce = 0, match_k = -1, flow_entries = 0, tenant_mode = 0, pack = 0;
+int			update_mode = 0, explore = 0, tuple_mode = 0;
+int			update_ops = 0, update_batch = 32, update_nodes = 0;
+FlowCache	*flow_cache = NULL;
+Capture		capture;
+char		*json_file, *bench_file;
+
+
+
+void usage(char *prog)
+{
+	printf("%s [-c strategy] [-A] [-o objective] [-w weight] [-s sample_trace] [-r hot_leaf_rules] [-l layout[:levels]] [-H 2m|1g] [-N] [-t threads] [-j json] [-b csv] [-R] [-m k] [-f entries] [-T] [-U] [-P] [-B] [-X] [-D ops[:batch[:nodes]]]\n"
+		   "    <leaf_rules> <bench> [trace | pcap | pcapng]\n", prog);
+	printf("  -c  cut strategy: band (default), hicuts (equal size range cuts), hypersplit (binary splits)\n");
+	printf("  -A  build with each cut strategy and compare the tries: replication per level, leaf sizes,\n"
+		   "      worst path, memory, and the lookups of the trace\n");
+	printf("  -o  cut objective: minmax (default), memory, entropy, traffic\n");
+	printf("  -w  objective weight: memory vs. depth for memory, max child for traffic\n");
+	printf("  -s  packet trace sampled for the traffic objective\n");
+	printf("  -r  rebuild the hot leaves of the trace with this leaf size\n");
+	printf("  -l  relayout the trie: bfs or veb, with the top levels in a dense block\n");
+	printf("  -H  back the relayout (or replicas) with 2MB or 1GB huge pages\n");
+	printf("  -N  replicate the trie on each NUMA node, lookups use the local one\n");
+	printf("  -t  throughput of 1 up to threads workers pinned to cores on a classifier handle\n");
+	printf("  -R  remove shadowed rules and merge adjacent rules of the same action before building\n");
+	printf("  -m  multi-match: all matching rules (k = 0) or the k of the lowest priority\n");
+	printf("  -f  flow cache of this many 5-tuples in front of the trie, per worker\n");
+	printf("  -P  pack the leaf rule lists as shared 16/32-bit rule id lists matched on rule boxes\n");
+	printf("  -B  pack the leaves (-P) with their rules stripped along the path in narrow lanes\n");
+	printf("  -X  tuple space search on the address prefixes, with band tries on the ports of the\n"
+		   "      address pairs of more than leaf_rules rules\n");
+	printf("  -D  post ops random rule adds, deletes and modifies, applied to the trie in batches of\n"
+		   "      this many (32 by default) touching up to nodes nodes (no cap by default), while a\n"
+		   "      worker classifies the trace\n");
+	printf("  -T  bench is a list of rule files, one per tenant, built into one shared store;\n"
+		   "      packet i of the trace is classified for tenant i %% #tenants\n");
+	printf("  -U  bench is a list of rule files posted as updates to the background rebuild, one at a\n"
+		   "      time then all at once, while a worker classifies the trace on the live version\n");
+	printf("  -j  write the build metrics as JSON to a file (timers with make profile, lookup histograms with make stats)\n");
+	printf("  -b  append the build and lookup rate of the trace as a CSV row to a file (make bench)\n");
+	exit(1);
+}
+
+
+
+// classify the trace with an image and check the results against a linear search
+void check_trace(Image *img)
+{
+	int		i, nerrors = 0;
+	Rule	*r0, *r1;
+
+	for (i = 0; i < num_packets; i++) {
+		r0 = lookup(img->root, img->brules, &img->pool, &trace[i]);
+		r1 = linear_classify(ruleset, num_rules, &trace[i]);
+		if (r0 != r1)
+			nerrors++;
+	}
+	printf("trace: %d packets, %d mismatches\n", num_packets, nerrors);
+}
+
+
+
+// check that the reduced rule set gives the loaded one's action to every packet of the trace
+void check_reduce()
+{
+	int		i, nerrors = 0;
+	Rule	*r0, *r1;
+
+	for (i = 0; i < num_packets; i++) {
+		r0 = linear_classify(ruleset, num_rules, &trace[i]);
+		r1 = linear_classify(loaded_rules, num_loaded_rules, &trace[i]);
+		if ((r0 == NULL) != (r1 == NULL) || (r0 != NULL && r0->action != r1->action))
+			nerrors++;
+	}
+	printf("reduce: %d packets, %d action mismatches\n", num_packets, nerrors);
+}
+
+
+
+// time the lookups of the trace, return Mpps
+double run_trace(Image *img, int rounds)
+{
+	struct timespec	t0, t1;
+	double			sec;
+	int				i, k;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (k = 0; k < rounds; k++) {
+		for (i = 0; i < num_packets; i++)
+			lookup(img->root, img->brules, &img->pool, &trace[i]);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	return (double) num_packets * rounds / sec / 1e6;
+}
+
+
+
+// classify the trace through the flow cache, cold then warm, against a linear search, then
+// time it; the cache is kept across calls so the sets of a replaced trie are seen stale
+void flow_trace(Image *img, char *label)
+{
+	struct timespec	t0, t1;
+	double			sec;
+	uint32_t		gen = __atomic_load_n(&trie_generation, __ATOMIC_ACQUIRE);
+	int				i, k, nerrors = 0, rounds = 10;
+
+	if (flow_cache == NULL)
+		flow_cache = flow_cache_new(flow_entries);
+	flow_cache->hits = flow_cache->misses = flow_cache->stale = 0;
+	for (k = 0; k < 2; k++) {
+		for (i = 0; i < num_packets; i++) {
+			if (flow_lookup(flow_cache, img->root, img->brules, &img->pool, &trace[i], gen)
+					!= linear_classify(ruleset, num_rules, &trace[i]))
+				nerrors++;
+		}
+	}
+	printf("flow cache trace: %d packets, %d mismatches\n", num_packets, nerrors);
+	flow_report(flow_cache, label);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (k = 0; k < rounds; k++) {
+		for (i = 0; i < num_packets; i++)
+			flow_lookup(flow_cache, img->root, img->brules, &img->pool, &trace[i], gen);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	printf("%s: %.2f Mpps\n", label, (double) num_packets * rounds / sec / 1e6);
+}
+
+
+
+// build the rule files listed in the file list as tenants of one store, then classify packet i of the
+// trace (if any) for tenant i % #tenants against a linear search of its rules, then time it
+void tenant_trace(char *list_file, int leaf_rules)
+{
+	TenantSet		*ts = tenants_new(huge_pages);
+	Rule			**rules = NULL, **out, *r;
+	int				*nrules = NULL, *tenants, ntenants = 0, size = 0, i, k, nerrors = 0, rounds = 10;
+	char			path[1024];
+	struct timespec	t0, t1;
+	double			sec;
+	FILE			*list;
+
+	if ((list = fopen(list_file, "r")) == NULL) {
+		fprintf(stderr, "Failed to open %s\n", list_file);
+		exit(1);
+	}
+	set_build_report(0);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	while (fscanf(list, "%1023s", path) == 1) {
+		if ((fp = fopen(path, "r")) == NULL) {
+			fprintf(stderr, "Failed to open %s\n", path);
+			exit(1);
+		}
+		if (ntenants == size) {
+			size = size > 0 ? size * 2 : 64;
+			rules = realloc(rules, size * sizeof(Rule *));
+			nrules = realloc(nrules, size * sizeof(int));
+		}
+		nrules[ntenants] = loadrules(fp, &rules[ntenants]);
+		fclose(fp);
+		tenants_add(ts, rules[ntenants], nrules[ntenants], leaf_rules, NULL);
+		ntenants++;
+	}
+	fclose(list);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	tenants_report(ts);
+	printf("tenant build: %.2f s\n", sec);
+	if (num_packets == 0 || ntenants == 0)
+		goto done;
+
+	tenants = malloc(num_packets * sizeof(int));
+	out = malloc(num_packets * sizeof(Rule *));
+	for (i = 0; i < num_packets; i++)
+		tenants[i] = i % ntenants;
+	tenants_classify(ts, tenants, trace, num_packets, out);
+	for (i = 0; i < num_packets; i++) {
+		// the store returns the pooled rule equal to the tenant's one
+		r = linear_classify(rules[tenants[i]], nrules[tenants[i]], &trace[i]);
+		if ((r == NULL) != (out[i] == NULL) || (r != NULL
+				&& (memcmp(r->field, out[i]->field, sizeof(r->field)) != 0 || r->action != out[i]->action)))
+			nerrors++;
+	}
+	printf("tenant trace: %d packets, %d mismatches\n", num_packets, nerrors);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (k = 0; k < rounds; k++)
+		tenants_classify(ts, tenants, trace, num_packets, out);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	printf("tenant batch: %.2f Mpps\n", (double) num_packets * rounds / sec / 1e6);
+	free(tenants);
+	free(out);
+
+done:
+	for (i = 0; i < ntenants; i++)
+		free(rules[i]);
+	free(rules);
+	free(nrules);
+	tenants_free(ts);
+}
+
+
+
+// classify the packets of the mapped capture in batches (through the flow cache with -f) and
+// report the hits of each rule and the throughput
+void replay_capture(Trie *root)
+{
+	Packet			batch[CAPTURE_BATCH];
+	Rule			*r;
+	uint64_t		*hits, npkts = 0;
+	uint32_t		gen = __atomic_load_n(&trie_generation, __ATOMIC_ACQUIRE);
+	struct timespec	t0, t1;
+	double			sec;
+	int				i, n;
+
+	hits = calloc(num_rules + 1, sizeof(uint64_t));		// last one: no match
+	if (flow_entries > 0 && flow_cache == NULL)
+		flow_cache = flow_cache_new(flow_entries);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	while ((n = capture_next(&capture, batch, CAPTURE_BATCH)) > 0) {
+		for (i = 0; i < n; i++) {
+			if (flow_cache != NULL)
+				r = flow_lookup(flow_cache, root, band_rules, &leaf_pool, &batch[i], gen);
+			else
+				r = lookup(root, band_rules, &leaf_pool, &batch[i]);
+			hits[r != NULL ? r->id : num_rules]++;
+		}
+		npkts += n;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+	printf("rule hits:\n");
+	for (i = 0; i < num_rules; i++) {
+		if (hits[i] > 0)
+			printf("  rule %d (line %d, action %d): %lu\n", i, ruleset[i].line, ruleset[i].action, hits[i]);
+	}
+	printf("  no match: %lu\n", hits[num_rules]);
+	printf("capture: %s, %lu frames, %lu classified (%lu IPv4-mapped IPv6), %lu skipped\n",
+			capture.format == CAPTURE_PCAP ? "pcap" : "pcapng", capture.frames, npkts,
+			capture.ipv6, capture.skipped);
+	printf("replay: %.2f Mpps, %.2f MB/s of capture\n", npkts / sec / 1e6, capture.size / sec / 1e6);
+	if (flow_cache != NULL)
+		flow_report(flow_cache, "flow cache");
+	free(hits);
+}
+
+
+
+// time the lookups of the trace with the cache and TLB misses per lookup when available
+void bench_trace(Image *img, char *label)
+{
+	PerfCtr		pc;
+	double		mpps;
+	int			i, rounds = 10;
+
+	perf_open(&pc);
+	perf_start(&pc);
+	mpps = run_trace(img, rounds);
+	perf_stop(&pc);
+
+	printf("%s: %.2f Mpps", label, mpps);
+	for (i = 0; i < NPERF; i++) {
+		if (pc.fd[i] >= 0)
+			printf(", %s/lookup %.3f", perf_names[i], (double) pc.count[i] / num_packets / rounds);
+		else
+			printf(", %s n/a", perf_names[i]);
+	}
+	printf("\n");
+	perf_close(&pc);
+}
+
+
+
+// append the bench row of the rule set to bench_file
+void bench_row(Image *img, char *bench)
+{
+	FILE	*fp;
+	char	*name = strrchr(bench, '/');
+	double	mpps = run_trace(img, 10);
+
+	if ((fp = fopen(bench_file, "a")) == NULL) {
+		fprintf(stderr, "Failed to open %s\n", bench_file);
+		exit(1);
+	}
+	dump_bench(fp, name != NULL ? name + 1 : bench, mpps);
+	fclose(fp);
+}
+
+
+
+void *reshape_thread(void *root)
+{
+	reshape_trie(root, hot_leaf_rules, HOT_SHARE);
+	return NULL;
+}
+
+
+
+// sample the lookups of the trace, reshape the hot subtrees in background while the trace is
+// classified again, then compare
+void adapt_trace(Trie *root)
+{
+	pthread_t	tid;
+	Image		img = trie_image(root);
+
+	hit_sampling = HIT_SAMPLE_RATE;
+	bench_trace(&img, "before reshape");
+	hit_report();
+
+	pthread_create(&tid, NULL, reshape_thread, root);
+	check_trace(&img);
+	pthread_join(tid, NULL);
+	layout_reclaim();
+
+	hit_reset();
+	bench_trace(&img, "after reshape");
+	hit_report();
+	check_trace(&img);
+	hit_sampling = 0;
+}
+
+
+
+// relayout the trie in BFS/vEB order and compare the lookups before and after
+Trie* layout_trace(Trie *root)
+{
+	Image	img = trie_image(root);
+
+	bench_trace(&img, "before layout");
+	root = layout_trie(root, layout_order, top_levels, huge_pages);
+	layout_reclaim();
+	img = trie_image(root);
+	bench_trace(&img, "after layout");
+	check_trace(&img);
+	return root;
+}
+
+
+
+// replicate the trie on each NUMA node and run the trace on the local replica
+void numa_trace(Trie *root)
+{
+	Image	images[MAX_NUMA_NODES], *img;
+	int		nimages;
+
+	nimages = image_replicate(images, root, layout_order < 0 ? LAYOUT_BFS : layout_order,
+			top_levels, huge_pages);
+	if (nimages == 0)
+		return;
+	img = image_local(images, nimages);
+	printf("local image: node %d\n", img->node);
+	bench_trace(img, "local replica");
+	check_trace(img);
+}
+
+
+
+typedef struct {
+	Classifier			*c;
+	int					core, rounds;
+	pthread_barrier_t	*start;
+} Worker;
+
+
+void *worker_thread(void *arg)
+{
+	Worker		*w = arg;
+	cpu_set_t	cpus;
+	int			i, k;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(w->core, &cpus);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	pthread_barrier_wait(w->start);
+
+	for (k = 0; k < w->rounds; k++) {
+		for (i = 0; i < num_packets; i++)
+			classifier_lookup(w->c, w->core, &trace[i]);
+	}
+	return NULL;
+}
+
+
+
+// run the trace on n workers pinned to cores 0..n-1, return the total Mpps
+double run_workers(Classifier *c, int n, int rounds)
+{
+	pthread_t			tid[n];
+	Worker				w[n];
+	pthread_barrier_t	start;
+	struct timespec		t0, t1;
+	double				sec;
+	int					i;
+
+	pthread_barrier_init(&start, NULL, n + 1);
+	for (i = 0; i < n; i++) {
+		w[i].c = c;
+		w[i].core = i % c->ncores;
+		w[i].rounds = rounds;
+		w[i].start = &start;
+		pthread_create(&tid[i], NULL, worker_thread, &w[i]);
+	}
+	pthread_barrier_wait(&start);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < n; i++)
+		pthread_join(tid[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	pthread_barrier_destroy(&start);
+
+	sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	return (double) num_packets * rounds * n / sec / 1e6;
+}
+
+
+
+// throughput scaling of pinned workers sharing one classifier handle, doubling the workers
+// up to num_workers
+void scale_trace(Trie *root)
+{
+	Classifier	*c;
+	CoreStats	sum;
+	double		mpps, mpps1 = 0;
+	int			n, rounds = 10;
+
+	c = classifier_new(root, layout_order < 0 ? LAYOUT_BFS : layout_order, top_levels, huge_pages);
+	if (c == NULL) {
+		fprintf(stderr, "Failed to make the classifier\n");
+		return;
+	}
+	if (flow_entries > 0)
+		classifier_flow_cache(c, flow_entries);
+	for (n = 1; ; n = n * 2 < num_workers ? n * 2 : num_workers) {
+		classifier_reset(c);
+		mpps = run_workers(c, n, rounds);
+		if (n == 1)
+			mpps1 = mpps;
+		classifier_stats(c, &sum);
+		printf("%d workers: %.2f Mpps (%.2fx), %lu lookups: %lu flow, %lu leaf, %lu cover, %lu miss\n",
+				n, mpps, mpps / mpps1, sum.lookups, sum.flow_hits, sum.leaf_hits, sum.cover_hits,
+				sum.misses);
+		if (n == num_workers)
+			break;
+	}
+	check_trace(c->core_image[0]);
+	classifier_free(c);
+}
+
+
+
+// worker classifying the trace in batches on whichever version is live
+typedef struct {
+	Rebuilder	*rb;
+	int			core, stop;
+	uint64_t	lookups;
+	double		max_batch_us;	// longest batch: a stall of the data plane would show here
+} LiveWorker;
+
+
+void *live_worker_thread(void *arg)
+{
+	LiveWorker		*w = arg;
+	Version			*v;
+	struct timespec	t0, t1;
+	double			us;
+	int				i, k = 0;
+
+	while (!__atomic_load_n(&w->stop, __ATOMIC_ACQUIRE)) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		if ((v = rebuild_acquire(w->rb, w->core)) == NULL) {
+			usleep(100);
+			continue;
+		}
+		for (i = 0; i < CAPTURE_BATCH; i++, k = k + 1 < num_packets ? k + 1 : 0)
+			classifier_lookup(v->c, w->core, &trace[k]);
+		rebuild_release(w->rb, w->core);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		us = (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3;
+		if (us > w->max_batch_us)
+			w->max_batch_us = us;
+		w->lookups += CAPTURE_BATCH;
+	}
+	return NULL;
+}
+
+
+
+void live_notify(Version *v, void *arg)
+{
+	printf("live: update %u, %d rules\n", v->seq, v->nrules);
+}
+
+
+
+// the trace on the live version v against a linear search of its rules; v stays live until
+// the next post
+int check_version(Version *v)
+{
+	Image	*img = v->c->core_image[0];
+	int		i, nerrors = 0;
+
+	for (i = 0; i < num_packets; i++)
+		nerrors += lookup(img->root, img->brules, &img->pool, &trace[i]) != linear_classify(v->rules, v->nrules, &trace[i]);
+	return nerrors;
+}
+
+
+
+// post the rule files of the list to the background rebuild, each waited for then all in a
+// burst, while a worker keeps classifying the trace on the live version
+void update_trace(char *list_file, int leaf_rules)
+{
+	Rebuilder		*rb;
+	LiveWorker		w = {0};
+	pthread_t		tid;
+	char			path[1024], **paths = NULL;
+	int				npaths = 0, i, nerrors = 0;
+	uint32_t		seq = 0;
+	struct timespec	t0, t1;
+	double			sec;
+	FILE			*list;
+
+	if ((list = fopen(list_file, "r")) == NULL) {
+		fprintf(stderr, "Failed to open %s\n", list_file);
+		exit(1);
+	}
+	while (fscanf(list, "%1023s", path) == 1) {
+		paths = realloc(paths, (npaths + 1) * sizeof(char *));
+		paths[npaths++] = strdup(path);
+	}
+	fclose(list);
+	if (npaths == 0 || num_packets == 0) {
+		fprintf(stderr, "Updates need rule files and a trace\n");
+		exit(1);
+	}
+
+	rb = rebuild_new(leaf_rules, reduce, layout_order < 0 ? LAYOUT_BFS : layout_order, top_levels, huge_pages);
+	rb->notify = live_notify;
+	w.rb = rb;
+	pthread_create(&tid, NULL, live_worker_thread, &w);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < npaths; i++) {
+		seq = rebuild_post(rb, paths[i]);
+		if (rebuild_wait(rb, seq))
+			nerrors += check_version(rb->live);
+	}
+	printf("updates one at a time: %d mismatches\n", nerrors);
+
+	// each post lands in the build of the previous one
+	for (i = 0; i < npaths; i++) {
+		seq = rebuild_post(rb, paths[i]);
+		usleep(20000);
+	}
+	nerrors = rebuild_wait(rb, seq) ? check_version(rb->live) : -1;
+	printf("updates in a burst: %d mismatches on the last one\n", nerrors);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	__atomic_store_n(&w.stop, 1, __ATOMIC_RELEASE);
+	pthread_join(tid, NULL);
+	sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	printf("lookups during updates: %.2f Mpps, longest batch of %d %.1f us\n",
+			w.lookups / sec / 1e6, CAPTURE_BATCH, w.max_batch_us);
+	rebuild_report(rb);
+	rebuild_free(rb);
+	for (i = 0; i < npaths; i++)
+		free(paths[i]);
+	free(paths);
+}
+
+
+
+// build the rule set with each cut strategy in turn and report the quality of the tries,
+// with the lookups of the trace when there is one
+void explore_cuts(int leaf_rules)
+{
+	Trie	*root;
+	Image	img;
+	char	*name;
+	int		i;
+
+	set_build_report(0);
+	for (i = 0; (name = cut_strategy_name(i)) != NULL; i++) {
+		set_cut_strategy(name);
+		root = build_trie(ruleset, num_rules, leaf_rules);
+		dump_quality(stdout);
+		if (num_packets > 0) {
+			img = trie_image(root);
+			printf("  ");
+			check_trace(&img);
+			printf("  lookups: %.2f Mpps\n", run_trace(&img, 10));
+		}
+		free_trie(root);
+		build_reset();
+	}
+}
+
+
+
+// build the tuple space of the rule set and classify the trace with it against a linear search
+void tuple_trace(int leaf_rules)
+{
+	TupleSpace		*sp;
+	struct timespec	t0, t1;
+	double			sec;
+	int				i, k, nerrors = 0, rounds = 10;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	sp = tuples_new(ruleset, num_rules, leaf_rules, huge_pages);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	printf("tuple build: %.1f ms\n", (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+	if (num_packets > 0) {
+		for (i = 0; i < num_packets; i++)
+			nerrors += tuples_lookup(sp, &trace[i]) != linear_classify(ruleset, num_rules, &trace[i]);
+		printf("tuple trace: %d packets, %d mismatches\n", num_packets, nerrors);
+
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (k = 0; k < rounds; k++) {
+			for (i = 0; i < num_packets; i++)
+				tuples_lookup(sp, &trace[i]);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+		printf("tuple lookups: %.2f Mpps\n", (double) num_packets * rounds / sec / 1e6);
+	}
+	tuples_report(sp);
+	tuples_free(sp);
+}
+
+
+
+int cmp_rule_priority(const void *a, const void *b)
+{
+	return (*(Rule **) a)->priority - (*(Rule **) b)->priority;
+}
+
+
+
+// check the multi-match lookups of the trace against a linear search, then time them
+void multi_trace(Trie *root)
+{
+	Rule			*m0[MAX_MATCHES], *m1[MAX_MATCHES];
+	struct timespec	t0, t1;
+	double			sec;
+	long			nmatches = 0;
+	int				i, j, k, n0, n1, nerrors = 0, rounds = 10;
+
+	for (i = 0; i < num_packets; i++) {
+		n0 = lookup_multi(root, band_rules, &trace[i], m0, match_k > 0 ? match_k : MAX_MATCHES, match_k > 0);
+		n1 = linear_classify_all(ruleset, num_rules, &trace[i], m1, MAX_MATCHES);
+		nmatches += n1;
+		if (n0 != n1) {
+			nerrors++;
+			continue;
+		}
+		// both keep the lowest ids of the matches past MAX_MATCHES
+		k = n1 < MAX_MATCHES ? n1 : MAX_MATCHES;
+		if (match_k > 0) {
+			// the k lowest priorities, ties in any order
+			qsort(m1, k, sizeof(Rule *), cmp_rule_priority);
+			k = k < match_k ? k : match_k;
+		}
+		for (j = 0; j < k; j++) {
+			if (match_k > 0 ? m0[j]->priority != m1[j]->priority : m0[j] != m1[j])
+				break;
+		}
+		nerrors += j < k;
+	}
+	printf("multi-match trace: %d packets, %.2f matches/packet, %d mismatches\n",
+			num_packets, (double) nmatches / num_packets, nerrors);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (k = 0; k < rounds; k++) {
+		for (i = 0; i < num_packets; i++)
+			lookup_multi(root, band_rules, &trace[i], m0, match_k > 0 ? match_k : MAX_MATCHES, match_k > 0);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	printf("multi-match: %.2f Mpps\n", (double) num_packets * rounds / sec / 1e6);
+}
+
+
+// worker classifying the trace in batches on the trie under rule updates
+typedef struct {
+	UpdateLog	*log;
+	int			core, stop;
+	uint64_t	lookups;
+	double		max_batch_us;
+} UpdateWorker;
+
+
+void *update_worker_thread(void *arg)
+{
+	UpdateWorker	*w = arg;
+	Trie			*root;
+	struct timespec	t0, t1;
+	double			us;
+	int				i, k = 0;
+
+	while (!__atomic_load_n(&w->stop, __ATOMIC_ACQUIRE)) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		root = updates_acquire(w->log, w->core);
+		for (i = 0; i < CAPTURE_BATCH; i++, k = k + 1 < num_packets ? k + 1 : 0)
+			lookup(root, w->log->brules, NULL, &trace[k]);
+		updates_release(w->log, w->core);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		us = (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3;
+		if (us > w->max_batch_us)
+			w->max_batch_us = us;
+		w->lookups += CAPTURE_BATCH;
+	}
+	return NULL;
+}
+
+
+
+// packets first .. first+n-1 of the trace on the trie against a linear search of the live rules
+int check_updates(UpdateLog *log, Rule *live, int first, int n)
+{
+	Rule	*r0, *r1;
+	int		nlive = updates_rules(log, live), i, k, nerrors = 0;
+
+	for (i = 0; i < n; i++) {
+		k = (first + i) % num_packets;
+		r0 = lookup(log->root, log->brules, NULL, &trace[k]);
+		r1 = linear_classify(live, nlive, &trace[k]);
+		nerrors += (r0 != NULL ? r0->id : -1) != (r1 != NULL ? r1->id : -1);
+	}
+	return nerrors;
+}
+
+
+
+inline uint32_t xorshift(uint32_t *x)
+{
+	*x ^= *x << 13;
+	*x ^= *x >> 17;
+	*x ^= *x << 5;
+	return *x;
+}
+
+
+
+// post random operations on the rule slots, all but the default rule: deletes, adds back of
+// the loaded rule, modifies to the fields of another rule, and deletes followed by an add of
+// the same rule, which cancel out; they are applied in batches while a worker classifies the
+// trace, and the trie is checked after each batch on a part of the trace and at the end on all
+void update_log_trace(int leaf_rules)
+{
+	UpdateLog		*log;
+	UpdateWorker	w = {0};
+	pthread_t		tid;
+	Rule			*live = malloc(num_rules * sizeof(Rule)), r;
+	uint32_t		x = 2463534242u;
+	int				i, slot, nerrors = 0, first = 0, check = 256;
+	struct timespec	t0, t1;
+	double			sec;
+
+	if (num_packets == 0 || num_rules < 2) {
+		fprintf(stderr, "Updates need rules and a trace\n");
+		exit(1);
+	}
+	log = updates_new(ruleset, num_rules, leaf_rules, update_nodes);
+	w.log = log;
+	pthread_create(&tid, NULL, update_worker_thread, &w);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < update_ops; i++) {
+		slot = xorshift(&x) % (num_rules - 1);
+		switch (xorshift(&x) % 4) {
+		case 0:
+			update_post(log, UPDATE_DELETE, slot, NULL);
+			break;
+		case 1:
+			update_post(log, UPDATE_ADD, slot, &ruleset[slot]);
+			break;
+		case 2:
+			r = ruleset[xorshift(&x) % (num_rules - 1)];
+			r.action = ruleset[slot].action;
+			update_post(log, UPDATE_MODIFY, slot, &r);
+			break;
+		default:
+			update_post(log, UPDATE_DELETE, slot, NULL);
+			update_post(log, UPDATE_ADD, slot, &ruleset[slot]);
+		}
+		if ((i + 1) % update_batch == 0 || i == update_ops - 1) {
+			updates_apply(log);
+			nerrors += check_updates(log, live, first, check);
+			first = (first + check) % num_packets;
+		}
+	}
+	while (log->nqueued > 0) {
+		updates_apply(log);
+		nerrors += check_updates(log, live, first, check);
+		first = (first + check) % num_packets;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	printf("updates: %d mismatches on %d packets after each batch\n", nerrors, check);
+	printf("updates: %d mismatches on the trace after all\n", check_updates(log, live, 0, num_packets));
+
+	__atomic_store_n(&w.stop, 1, __ATOMIC_RELEASE);
+	pthread_join(tid, NULL);
+	sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	printf("lookups during updates: %.2f Mpps, longest batch of %d %.1f us\n",
+			w.lookups / sec / 1e6, CAPTURE_BATCH, w.max_batch_us);
+	updates_report(log);
+	updates_free(log);
+	free(live);
+}
+
 
 
 int main(int argc, char **argv)
 {
-	int		leaf_rules;
-	
-	if (argc != 3) {
-		printf("%s <leaf_rules> <bench>\n", argv[0]);
+	int		leaf_rules, opt, nsamples;
+	char	*objective = "minmax", *strategy = "band";
+	double	weight = -1;
+	Packet	*samples;
+	Trie	*root;
+	Image	img;
+
+	while ((opt = getopt(argc, argv, "c:Ao:w:s:r:l:H:Nt:j:b:Rm:f:TUPBXD:")) != -1) {
+		switch (opt) {
+		case 'c':
+			strategy = optarg;
+			break;
+		case 'A':
+			explore = 1;
+			break;
+		case 'o':
+			objective = optarg;
+			break;
+		case 'w':
+			weight = atof(optarg);
+			break;
+		case 's':
+			fp = fopen(optarg, "r");
+			if (fp == NULL) {
+				fprintf(stderr, "Failed to open sample trace file\n");
+				exit(0);
+			}
+			nsamples = loadtrace(fp, &samples);
+			fclose(fp);
+			set_cut_samples(samples, nsamples);
+			free(samples);
+			break;
+		case 'r':
+			hot_leaf_rules = atoi(optarg);
+			break;
+		case 'l':
+			if (strncmp(optarg, "bfs", 3) == 0)
+				layout_order = LAYOUT_BFS;
+			else if (strncmp(optarg, "veb", 3) == 0)
+				layout_order = LAYOUT_VEB;
+			else
+				usage(argv[0]);
+			if (optarg[3] == ':')
+				top_levels = atoi(optarg + 4);
+			break;
+		case 'H':
+			huge_pages = strcmp(optarg, "1g") == 0 ? HUGE_1GB : HUGE_2MB;
+			break;
+		case 'N':
+			replicate = 1;
+			break;
+		case 't':
+			num_workers = atoi(optarg);
+			break;
+		case 'j':
+			json_file = optarg;
+			break;
+		case 'b':
+			bench_file = optarg;
+			break;
+		case 'R':
+			reduce = 1;
+			break;
+		case 'm':
+			match_k = atoi(optarg);
+			break;
+		case 'f':
+			flow_entries = atoi(optarg);
+			break;
+		case 'T':
+			tenant_mode = 1;
+			break;
+		case 'U':
+			update_mode = 1;
+			break;
+		case 'P':
+			pack = 1;
+			break;
+		case 'B':
+			pack = 2;
+			break;
+		case 'X':
+			tuple_mode = 1;
+			break;
+		case 'D':
+			update_ops = atoi(optarg);
+			if ((optarg = strchr(optarg, ':')) != NULL) {
+				update_batch = atoi(optarg + 1);
+				if ((optarg = strchr(optarg + 1, ':')) != NULL)
+					update_nodes = atoi(optarg + 1);
+			}
+			if (update_ops <= 0 || update_batch <= 0)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 2 && argc - optind != 3)
+		usage(argv[0]);
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	if (!set_cut_objective(objective, weight)) {
+		fprintf(stderr, "Unknown cut objective: %s\n", objective);
+		exit(1);
+	}
+	if (!set_cut_strategy(strategy)) {
+		fprintf(stderr, "Unknown cut strategy: %s\n", strategy);
 		exit(1);
 	}
 
 	leaf_rules = atoi(argv[1]);
 	leaf_rules = leaf_rules==0 ? 4 : leaf_rules;
 
+	if (tenant_mode || update_mode) {
+		if (argc == 4) {
+			if ((fp = fopen(argv[3], "r")) == NULL) {
+				fprintf(stderr, "Failed to open trace file\n");
+				exit(0);
+			}
+			num_packets = loadtrace(fp, &trace);
+			fclose(fp);
+		}
+		if (tenant_mode)
+			tenant_trace(argv[2], leaf_rules);
+		else
+			update_trace(argv[2], leaf_rules);
+		goto out;
+	}
+
 	fp = fopen(argv[2], "r");
 
 	if (fp == NULL) {
@@ -33,7 +989,83 @@ int main(int argc, char **argv)
 	num_rules = loadrules(fp, &ruleset);
 	fclose(fp);
 	//dump_ruleset(ruleset, num_rules);
-	build_trie(ruleset, num_rules, leaf_rules);
+	if (reduce) {
+		num_loaded_rules = num_rules;
+		loaded_rules = malloc(num_rules * sizeof(Rule));
+		memcpy(loaded_rules, ruleset, num_rules * sizeof(Rule));
+		num_rules = reduce_rules(ruleset, num_rules);
+	}
+	if (explore || tuple_mode || update_ops > 0) {
+		if (argc == 4) {
+			if ((fp = fopen(argv[3], "r")) == NULL) {
+				fprintf(stderr, "Failed to open trace file\n");
+				exit(0);
+			}
+			num_packets = loadtrace(fp, &trace);
+			fclose(fp);
+		}
+		if (explore)
+			explore_cuts(leaf_rules);
+		else if (tuple_mode)
+			tuple_trace(leaf_rules);
+		else
+			update_log_trace(leaf_rules);
+		goto out;
+	}
+	if (match_k >= 0)
+		set_multi_match(1);
+	root = build_trie(ruleset, num_rules, leaf_rules);
+	if (pack && match_k < 0)
+		pack_leaves(pack == 2);
+	if (argc == 4 && match_k < 0 && capture_open(&capture, argv[3])) {
+		replay_capture(root);
+		capture_close(&capture);
+	} else if (argc == 4) {
+		fp = fopen(argv[3], "r");
+		if (fp == NULL) {
+			fprintf(stderr, "Failed to open trace file\n");
+			exit(0);
+		}
+		num_packets = loadtrace(fp, &trace);
+		fclose(fp);
+		if (match_k >= 0) {
+			multi_trace(root);
+			goto out;
+		}
+		img = trie_image(root);
+		check_trace(&img);
+		if (bench_file != NULL)
+			bench_row(&img, argv[2]);
+		if (reduce)
+			check_reduce();
+		if (flow_entries > 0)
+			flow_trace(&img, "flow cache");
+		if (replicate)
+			numa_trace(root);
+		if (num_workers > 0)
+			scale_trace(root);
+		if (layout_order >= 0)
+			root = layout_trace(root);
+		if (hot_leaf_rules > 0)
+			adapt_trace(root);
+		if (flow_entries > 0 && (layout_order >= 0 || hot_leaf_rules > 0)) {
+			img = trie_image(root);
+			flow_trace(&img, "flow cache, new trie");
+		}
+	} else if (layout_order >= 0) {
+		root = layout_trie(root, layout_order, top_levels, huge_pages);
+	}
+
+out:
+	dump_lookup_stats(stdout, 0);
+	if (json_file != NULL) {
+		if ((fp = fopen(json_file, "w")) == NULL) {
+			fprintf(stderr, "Failed to open %s\n", json_file);
+			exit(1);
+		}
+		dump_json(fp);
+		fclose(fp);
+	}
 
 	//test_band();
 }
@@ -0,0 +1,116 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include "numa.h"
+
+
+int		num_numa_nodes;
+int		numa_nodes[MAX_NUMA_NODES];		// ids of the online nodes
+int		cpu_nodes[MAX_CPUS];
+
+
+
+// find the NUMA nodes and their cpus from sysfs, return #nodes (at least 1)
+int numa_scan()
+{
+	FILE	*fp;
+	char	path[64];
+	int		node, lo, hi, cpu, n;
+
+	num_numa_nodes = 0;
+	for (node = 0; node < MAX_NUMA_NODES; node++) {
+		sprintf(path, "/sys/devices/system/node/node%d/cpulist", node);
+		if ((fp = fopen(path, "r")) == NULL)
+			continue;
+		// e.g. 0-7,16-23
+		while ((n = fscanf(fp, "%d-%d", &lo, &hi)) >= 1) {
+			if (n == 1)
+				hi = lo;
+			for (cpu = lo; cpu <= hi && cpu < MAX_CPUS; cpu++)
+				cpu_nodes[cpu] = node;
+			if (fgetc(fp) != ',')
+				break;
+		}
+		fclose(fp);
+		numa_nodes[num_numa_nodes++] = node;
+	}
+	if (num_numa_nodes == 0)
+		numa_nodes[num_numa_nodes++] = 0;
+	return num_numa_nodes;
+}
+
+
+
+int cpu_node(int cpu)
+{
+	return cpu >= 0 && cpu < MAX_CPUS ? cpu_nodes[cpu] : 0;
+}
+
+
+
+// the built trie as an image, not a replica
+Image trie_image(Trie *root)
+{
+	Image	img;
+
+	img.root = root;
+	img.brules = band_rules;
+	img.pool = leaf_pool;
+	img.arena = NULL;
+	img.node = -1;
+	return img;
+}
+
+
+
+// make a replica of the trie, the rules in ternary form and the packed leaf data on each NUMA
+// node, laid out like layout_trie() in an arena bound to the node; return #images made
+int image_replicate(Image *images, Trie *root, int order, int top_levels, int huge)
+{
+	Arena	*a;
+	size_t	rule_bytes, box_bytes, id_bytes;
+	int		i, n = 0;
+
+	if (num_numa_nodes == 0)
+		numa_scan();
+	rule_bytes = band_rules_bytes(band_rules, total_rules);
+	box_bytes = leaf_pool.nboxes * sizeof(RuleBox);
+	id_bytes = leaf_pool.nids * leaf_pool.id_bytes;
+
+	for (i = 0; i < num_numa_nodes; i++) {
+		a = arena_new(2 * trie_bytes(root) + 2 * PAGE_SIZE + rule_bytes + box_bytes + id_bytes + 16, huge);
+		if (a == NULL)
+			break;
+		images[n].node = arena_bind(a, numa_nodes[i]) ? numa_nodes[i] : -1;
+		images[n].pool = leaf_pool;
+		if (leaf_pool.boxes != NULL) {
+			images[n].pool.boxes = memcpy(arena_alloc_aligned(a, box_bytes, 16), leaf_pool.boxes, box_bytes);
+			images[n].pool.ids = memcpy(arena_alloc(a, id_bytes), leaf_pool.ids, id_bytes);
+		}
+		images[n].root = layout_into(root, a, order, top_levels, &images[n].pool);
+		images[n].brules = band_rules_clone(band_rules, total_rules, arena_alloc(a, rule_bytes));
+		images[n].arena = a;
+		arena_trim(a);
+
+		printf("image[%d] for node %d: ", n, numa_nodes[i]);
+		arena_report(a);
+		n++;
+	}
+	return n;
+}
+
+
+
+// the image on the NUMA node of the calling thread, the first one if none there
+Image* image_local(Image *images, int nimages)
+{
+	int		node = cpu_node(sched_getcpu()), i;
+
+	for (i = 0; i < nimages; i++) {
+		if (images[i].node == node)
+			return &images[i];
+	}
+	return &images[0];
+}
@@ -0,0 +1,29 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include "trie.h"
+#include "layout.h"
+
+#define MAX_NUMA_NODES	16
+#define MAX_CPUS		1024
+
+
+// read-only lookup image: a trie with the rules in ternary form it matches against, and the
+// packed leaf data of its leaves
+typedef struct {
+	Trie		*root;
+	BandRule	*brules;
+	LeafPool	pool;
+	Arena		*arena;		// where the replica is, NULL for the built trie
+	int			node;		// NUMA node the replica is bound to, -1 for none
+} Image;
+
+
+int numa_scan();
+int cpu_node(int cpu);
+
+Image trie_image(Trie *root);
+int image_replicate(Image *images, Trie *root, int order, int top_levels, int huge);
+Image* image_local(Image *images, int nimages);
+
+#endif
@@ -0,0 +1,355 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "pcap.h"
+
+
+#define PCAP_MAGIC			0xA1B2C3D4
+#define PCAP_MAGIC_NSEC		0xA1B23C4D
+#define PCAPNG_SHB			0x0A0D0D0A	// section header block
+#define PCAPNG_IDB			1			// interface description block
+#define PCAPNG_SPB			3			// simple packet block
+#define PCAPNG_EPB			6			// enhanced packet block
+#define PCAPNG_BYTE_ORDER	0x1A2B3C4D
+
+// link types
+#define LINK_NULL			0
+#define LINK_ETHERNET		1
+#define LINK_RAW			101
+#define LINK_SLL			113
+#define LINK_IPV4			228
+#define LINK_IPV6			229
+#define LINK_SLL2			276
+
+#define ETHER_IPV4			0x0800
+#define ETHER_IPV6			0x86DD
+#define ETHER_VLAN			0x8100
+#define ETHER_QINQ			0x88A8
+
+
+
+/******************************************************************************
+ *
+ * Section for the packet headers
+ *
+ ******************************************************************************/
+
+
+inline uint32_t get16(uint8_t *p)
+{
+	return p[0] << 8 | p[1];
+}
+
+
+
+inline uint32_t get32(uint8_t *p)
+{
+	return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+
+
+// ports of a TCP, UDP or SCTP header at p, 0 for other protocols or when not captured
+void parse_ports(uint8_t *p, uint8_t *end, int proto, Packet *pkt)
+{
+	pkt->field[2] = pkt->field[3] = 0;
+	if ((proto == 6 || proto == 17 || proto == 132) && p + 4 <= end) {
+		pkt->field[2] = get16(p);
+		pkt->field[3] = get16(p + 2);
+	}
+}
+
+
+
+int parse_ipv4(uint8_t *p, uint8_t *end, Packet *pkt)
+{
+	int		ihl;
+
+	if (p + 20 > end || p[0] >> 4 != 4)
+		return 0;
+	// a header length below the fixed header is malformed
+	if ((ihl = (p[0] & 0xF) * 4) < 20)
+		return 0;
+	pkt->field[0] = get32(p + 12);
+	pkt->field[1] = get32(p + 16);
+	pkt->field[4] = p[9];
+	// only the first fragment has the ports
+	if (get16(p + 6) & 0x1FFF)
+		parse_ports(end, end, 0, pkt);
+	else
+		parse_ports(p + ihl, end, p[9], pkt);
+	return 1;
+}
+
+
+
+// an IPv6 packet whose both addresses are IPv4-mapped (::ffff:a.b.c.d), the rules being IPv4;
+// the extension headers are walked to the transport header
+int parse_ipv6(uint8_t *p, uint8_t *end, Packet *pkt)
+{
+	static const uint8_t	mapped[12] = {0,0,0,0, 0,0,0,0, 0,0,0xFF,0xFF};
+	int		next;
+
+	if (p + 40 > end || p[0] >> 4 != 6
+			|| memcmp(p + 8, mapped, 12) != 0 || memcmp(p + 24, mapped, 12) != 0)
+		return 0;
+	pkt->field[0] = get32(p + 20);
+	pkt->field[1] = get32(p + 36);
+	next = p[6];
+	p += 40;
+	for (;;) {
+		if (next == 0 || next == 43 || next == 60) {		// hop-by-hop, routing, destination
+			if (p + 8 > end)
+				break;
+			next = p[0];
+			p += (p[1] + 1) * 8;
+		} else if (next == 44) {						// fragment
+			if (p + 8 > end)
+				break;
+			next = p[0];
+			if (get16(p + 2) & 0xFFF8) {
+				pkt->field[4] = next;
+				parse_ports(end, end, 0, pkt);
+				return 1;
+			}
+			p += 8;
+		} else {
+			break;
+		}
+	}
+	pkt->field[4] = next;
+	parse_ports(p, end, next, pkt);
+	return 1;
+}
+
+
+
+// the 5-tuple of a frame of link type link; 0 when it has none the rules can match
+int parse_frame(uint8_t *p, uint32_t caplen, int link, Capture *cap, Packet *pkt)
+{
+	uint8_t		*end = p + caplen;
+	uint32_t	type;
+
+	switch (link) {
+	case LINK_ETHERNET:
+		if (p + 14 > end)
+			return 0;
+		type = get16(p + 12);
+		p += 14;
+		while ((type == ETHER_VLAN || type == ETHER_QINQ) && p + 4 <= end) {
+			type = get16(p + 2);
+			p += 4;
+		}
+		break;
+	case LINK_SLL:
+		if (p + 16 > end)
+			return 0;
+		type = get16(p + 14);
+		p += 16;
+		break;
+	case LINK_SLL2:
+		if (p + 20 > end)
+			return 0;
+		type = get16(p);
+		p += 20;
+		break;
+	case LINK_NULL:
+		// address family in the byte order of the capturing host
+		if (p + 4 > end)
+			return 0;
+		type = p[0] == 2 || p[3] == 2 ? ETHER_IPV4 : ETHER_IPV6;
+		p += 4;
+		break;
+	case LINK_RAW:
+	case LINK_IPV4:
+	case LINK_IPV6:
+		if (p + 1 > end)
+			return 0;
+		type = p[0] >> 4 == 4 ? ETHER_IPV4 : ETHER_IPV6;
+		break;
+	default:
+		return 0;
+	}
+	if (type == ETHER_IPV4)
+		return parse_ipv4(p, end, pkt);
+	if (type == ETHER_IPV6 && parse_ipv6(p, end, pkt)) {
+		cap->ipv6++;
+		return 1;
+	}
+	return 0;
+}
+
+
+
+/******************************************************************************
+ *
+ * Section for the capture file formats
+ *
+ ******************************************************************************/
+
+
+// a 16/32-bit field of the file headers
+inline uint32_t file16(Capture *cap, uint8_t *p)
+{
+	uint16_t	v;
+
+	memcpy(&v, p, 2);
+	return cap->swap ? __builtin_bswap16(v) : v;
+}
+
+
+
+inline uint32_t file32(Capture *cap, uint8_t *p)
+{
+	uint32_t	v;
+
+	memcpy(&v, p, 4);
+	return cap->swap ? __builtin_bswap32(v) : v;
+}
+
+
+
+// map a capture file and read its header; 0 when it is not pcap or pcapng
+int capture_open(Capture *cap, char *path)
+{
+	struct stat	st;
+	uint32_t	magic;
+	int			fd;
+
+	memset(cap, 0, sizeof(Capture));
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return 0;
+	if (fstat(fd, &st) < 0 || st.st_size < 24) {
+		close(fd);
+		return 0;
+	}
+	if (pread(fd, &magic, 4, 0) != 4) {
+		close(fd);
+		return 0;
+	}
+	if (magic == PCAP_MAGIC || magic == PCAP_MAGIC_NSEC) {
+		cap->format = CAPTURE_PCAP;
+	} else if (magic == __builtin_bswap32(PCAP_MAGIC) || magic == __builtin_bswap32(PCAP_MAGIC_NSEC)) {
+		cap->format = CAPTURE_PCAP;
+		cap->swap = 1;
+	} else if (magic == PCAPNG_SHB) {
+		cap->format = CAPTURE_PCAPNG;
+	} else {
+		close(fd);
+		return 0;
+	}
+
+	cap->size = st.st_size;
+	cap->base = mmap(NULL, cap->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (cap->base == MAP_FAILED) {
+		perror("mmap capture");
+		return 0;
+	}
+	madvise(cap->base, cap->size, MADV_SEQUENTIAL);
+	cap->end = cap->base + cap->size;
+
+	if (cap->format == CAPTURE_PCAP) {
+		cap->linktype = file32(cap, cap->base + 20) & 0xFFFF;
+		cap->next = cap->base + 24;
+	} else {
+		cap->next = cap->base;		// the section header sets the byte order
+	}
+	return 1;
+}
+
+
+
+int pcap_next(Capture *cap, uint8_t **frame, uint32_t *caplen, int *link)
+{
+	uint8_t		*p = cap->next;
+
+	if (p + 16 > cap->end)
+		return 0;
+	*caplen = file32(cap, p + 8);
+	*frame = p + 16;
+	*link = cap->linktype;
+	if (*caplen > cap->end - *frame)
+		return 0;
+	cap->next = *frame + *caplen;
+	return 1;
+}
+
+
+
+// the next packet block, reading the section and interface blocks on the way
+int pcapng_next(Capture *cap, uint8_t **frame, uint32_t *caplen, int *link)
+{
+	uint8_t		*p;
+	uint32_t	type, len, magic, ifid;
+
+	while ((p = cap->next) + 12 <= cap->end) {
+		memcpy(&type, p, 4);
+		if (type == PCAPNG_SHB) {
+			memcpy(&magic, p + 8, 4);
+			cap->swap = magic != PCAPNG_BYTE_ORDER;
+			cap->nifs = 0;
+		} else if (cap->swap) {
+			type = __builtin_bswap32(type);
+		}
+		len = file32(cap, p + 4);
+		if (len < 12 || len > cap->end - p)
+			return 0;
+		cap->next = p + len;
+
+		if (type == PCAPNG_IDB && len >= 20) {
+			if (cap->nifs < PCAPNG_MAX_IFS)
+				cap->if_link[cap->nifs] = file16(cap, p + 8);
+			cap->nifs++;
+		} else if (type == PCAPNG_EPB && len >= 32) {
+			ifid = file32(cap, p + 8);
+			*caplen = file32(cap, p + 20);
+			*frame = p + 28;
+			if (ifid >= cap->nifs || ifid >= PCAPNG_MAX_IFS || *caplen > len - 32)
+				continue;
+			*link = cap->if_link[ifid];
+			return 1;
+		} else if (type == PCAPNG_SPB && len >= 16 && cap->nifs > 0) {
+			*caplen = file32(cap, p + 8);
+			if (*caplen > len - 16)
+				*caplen = len - 16;
+			*frame = p + 12;
+			*link = cap->if_link[0];
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+
+// parse up to max packets with a 5-tuple into batch, return #packets, 0 at the end of the file
+int capture_next(Capture *cap, Packet *batch, int max)
+{
+	uint8_t		*frame;
+	uint32_t	caplen;
+	int			link, n = 0;
+
+	while (n < max) {
+		if (cap->format == CAPTURE_PCAP ? !pcap_next(cap, &frame, &caplen, &link)
+				: !pcapng_next(cap, &frame, &caplen, &link))
+			break;
+		cap->frames++;
+		if (parse_frame(frame, caplen, link, cap, &batch[n]))
+			n++;
+		else
+			cap->skipped++;
+	}
+	return n;
+}
+
+
+
+void capture_close(Capture *cap)
+{
+	munmap(cap->base, cap->size);
+}
@@ -0,0 +1,33 @@
+#ifndef PCAP_H
+#define PCAP_H
+
+#include <stddef.h>
+#include "rule.h"
+
+#define CAPTURE_BATCH	256		// packets parsed before they are classified
+#define PCAPNG_MAX_IFS	64
+
+enum { CAPTURE_PCAP, CAPTURE_PCAPNG };
+
+
+// a pcap or pcapng file mapped read-only, parsed in place record by record
+typedef struct {
+	uint8_t		*base, *end;
+	uint8_t		*next;				// next record (pcap) or block (pcapng)
+	size_t		size;
+	int			format;				// CAPTURE_*
+	int			swap;				// written in the other byte order
+	int			linktype;			// pcap: of every record
+	int			if_link[PCAPNG_MAX_IFS];	// pcapng: of each interface of the section
+	int			nifs;
+	uint64_t	frames;				// records read
+	uint64_t	ipv6;				// IPv6 packets classified, with IPv4-mapped addresses
+	uint64_t	skipped;			// not IPv4 or IPv4-mapped IPv6, or truncated
+} Capture;
+
+
+int capture_open(Capture *cap, char *path);
+int capture_next(Capture *cap, Packet *batch, int max);
+void capture_close(Capture *cap);
+
+#endif
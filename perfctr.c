@@ -0,0 +1,107 @@
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <linux/perf_event.h>
+#include "perfctr.h"
+
+
+char		*perf_names[NPERF] = {"cache-misses", "LLC-load-misses", "dTLB-load-misses"};
+
+char		*prof_names[NPROF] = {"choose_cut", "try_cut", "select_rules", "calc_rule_redun",
+	"check_node_redun"};
+uint64_t	prof_ns[NPROF], prof_calls[NPROF];
+
+uint32_t	perf_types[NPERF] = {PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE};
+uint64_t	perf_configs[NPERF] = {
+	PERF_COUNT_HW_CACHE_MISSES,
+	PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+	PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+};
+
+
+
+// open the hardware counters of this thread in user space, return #counters available
+int perf_open(PerfCtr *pc)
+{
+	struct perf_event_attr	attr;
+	int						i, n = 0;
+
+	for (i = 0; i < NPERF; i++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = perf_types[i];
+		attr.config = perf_configs[i];
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		pc->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		pc->count[i] = 0;
+		n += pc->fd[i] >= 0;
+	}
+	return n;
+}
+
+
+
+void perf_start(PerfCtr *pc)
+{
+	int		i;
+
+	for (i = 0; i < NPERF; i++) {
+		if (pc->fd[i] < 0)
+			continue;
+		ioctl(pc->fd[i], PERF_EVENT_IOC_RESET, 0);
+		ioctl(pc->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+	}
+}
+
+
+
+void perf_stop(PerfCtr *pc)
+{
+	int		i;
+
+	for (i = 0; i < NPERF; i++) {
+		if (pc->fd[i] < 0)
+			continue;
+		ioctl(pc->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+		if (read(pc->fd[i], &pc->count[i], sizeof(uint64_t)) != sizeof(uint64_t))
+			pc->count[i] = 0;
+	}
+}
+
+
+
+void perf_close(PerfCtr *pc)
+{
+	int		i;
+
+	for (i = 0; i < NPERF; i++) {
+		if (pc->fd[i] >= 0)
+			close(pc->fd[i]);
+		pc->fd[i] = -1;
+	}
+}
+
+
+
+uint64_t prof_now()
+{
+	struct timespec	t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000UL + t.tv_nsec;
+}
+
+
+
+long peak_rss_kb()
+{
+	struct rusage	ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_maxrss;
+}
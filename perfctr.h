@@ -0,0 +1,42 @@
+#ifndef PERFCTR_H
+#define PERFCTR_H
+
+#include <stdint.h>
+
+#define NPERF	3		// cache misses, LLC load misses, dTLB load misses
+
+typedef struct {
+	int			fd[NPERF];		// -1 when the counter is not available
+	uint64_t	count[NPERF];
+} PerfCtr;
+
+extern char *perf_names[NPERF];
+
+int perf_open(PerfCtr *pc);
+void perf_start(PerfCtr *pc);
+void perf_stop(PerfCtr *pc);
+void perf_close(PerfCtr *pc);
+
+
+// scoped build timers, compiled in with -DPROFILE (make profile) and free otherwise
+enum {PROF_CHOOSE_CUT, PROF_TRY_CUT, PROF_SELECT_RULES, PROF_CALC_RULE_REDUN,
+	PROF_CHECK_NODE_REDUN, NPROF};
+
+extern char		*prof_names[NPROF];
+extern uint64_t	prof_ns[NPROF], prof_calls[NPROF];
+
+#ifdef PROFILE
+#define PROF_START(t)	uint64_t prof_t0_##t = prof_now()
+#define PROF_STOP(t)	do {										\
+		prof_ns[t] += prof_now() - prof_t0_##t;						\
+		prof_calls[t]++;											\
+	} while (0)
+#else
+#define PROF_START(t)
+#define PROF_STOP(t)
+#endif
+
+uint64_t prof_now();
+long peak_rss_kb();
+
+#endif
@@ -0,0 +1,284 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "rule.h"
+#include "rebuild.h"
+
+
+
+double ms_since(struct timespec *t0)
+{
+	struct timespec	t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) * 1e3 + (t1.tv_nsec - t0->tv_nsec) / 1e6;
+}
+
+
+
+inline int build_cancelled()
+{
+	return __atomic_load_n(&build_cancel, __ATOMIC_RELAXED);
+}
+
+
+
+// free a version once no core classifies on it; it is not live any more, so the cores
+// getting off it do not come back
+void version_retire(Rebuilder *rb, Version *v)
+{
+	int		i;
+
+	if (v->c == NULL)
+		return;
+	for (i = 0; i < rb->ncores; i++) {
+		while (__atomic_load_n(&rb->epochs[i].seq, __ATOMIC_SEQ_CST) == v->seq)
+			usleep(50);
+	}
+	classifier_free(v->c);
+	free(v->rules);
+	v->rules = NULL;
+	v->nrules = 0;
+	v->c = NULL;
+	__atomic_store_n(&v->seq, 0, __ATOMIC_SEQ_CST);
+}
+
+
+
+// parse, reduce, build and flatten the rule file into v; the trie is built with the global
+// state of build_trie(), so one version is built at a time. Return 0 if cancelled by a post.
+int version_build(Rebuilder *rb, Version *v, char *path)
+{
+	struct timespec	t0;
+	FILE			*fp;
+	Trie			*root;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if ((fp = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "Failed to open %s\n", path);
+		return 0;
+	}
+	v->nrules = loadrules(fp, &v->rules);
+	fclose(fp);
+	rb->stage_ms[0] = ms_since(&t0);
+	if (build_cancelled() || v->nrules == 0)
+		goto cancel;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (rb->reduce)
+		v->nrules = reduce_rules(v->rules, v->nrules);
+	rb->stage_ms[1] = ms_since(&t0);
+	if (build_cancelled())
+		goto cancel;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	root = build_trie(v->rules, v->nrules, rb->leaf_rules);
+	rb->stage_ms[2] = ms_since(&t0);
+	if (build_cancelled()) {
+		free_trie(root);
+		build_reset();
+		goto cancel;
+	}
+
+	// the images are copies, the built trie is not needed after this
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	v->c = classifier_new(root, rb->order, rb->top_levels, rb->huge);
+	free_trie(root);
+	build_reset();
+	rb->stage_ms[3] = ms_since(&t0);
+	if (v->c != NULL && !build_cancelled())
+		return 1;
+	if (v->c != NULL)
+		classifier_free(v->c);
+	v->c = NULL;
+
+cancel:
+	free(v->rules);
+	v->rules = NULL;
+	return 0;
+}
+
+
+
+void* rebuild_thread(void *arg)
+{
+	Rebuilder		*rb = arg;
+	Version			*v;
+	struct timespec	posted_at;
+	uint32_t		seq;
+	char			*path;
+	double			ms;
+
+	pthread_mutex_lock(&rb->lock);
+	for (;;) {
+		while (rb->next == NULL && !rb->stop)
+			pthread_cond_wait(&rb->posted, &rb->lock);
+		if (rb->stop)
+			break;
+		path = rb->next;
+		seq = rb->next_seq;
+		posted_at = rb->posted_at;
+		rb->next = NULL;
+		__atomic_store_n(&build_cancel, 0, __ATOMIC_RELAXED);
+		rb->builds++;
+		pthread_mutex_unlock(&rb->lock);
+
+		// build into the slot that is not live
+		v = rb->live == &rb->slot[0] ? &rb->slot[1] : &rb->slot[0];
+		version_retire(rb, v);
+		__atomic_store_n(&v->seq, seq, __ATOMIC_SEQ_CST);
+		if (!version_build(rb, v, path)) {
+			free(path);
+			pthread_mutex_lock(&rb->lock);
+			if (build_cancelled()) {
+				rb->cancels++;
+			} else {
+				// a rule file that fails is done with, the live version stays
+				rb->done_seq = seq;
+				pthread_cond_broadcast(&rb->published);
+			}
+			continue;
+		}
+		free(path);
+
+		pthread_mutex_lock(&rb->lock);
+		__atomic_store_n(&rb->live, v, __ATOMIC_SEQ_CST);
+		rb->live_seq = rb->done_seq = seq;
+		rb->publishes++;
+		ms = ms_since(&posted_at);
+		if (ms > rb->max_post_ms)
+			rb->max_post_ms = ms;
+		pthread_cond_broadcast(&rb->published);
+		if (rb->notify != NULL) {
+			pthread_mutex_unlock(&rb->lock);
+			rb->notify(v, rb->notify_arg);
+			pthread_mutex_lock(&rb->lock);
+		}
+	}
+	pthread_mutex_unlock(&rb->lock);
+	return NULL;
+}
+
+
+
+Rebuilder* rebuild_new(int leaf_rules, int reduce, int order, int top_levels, int huge)
+{
+	Rebuilder	*rb = calloc(1, sizeof(Rebuilder));
+
+	rb->leaf_rules = leaf_rules;
+	rb->reduce = reduce;
+	rb->order = order;
+	rb->top_levels = top_levels;
+	rb->huge = huge;
+	rb->ncores = sysconf(_SC_NPROCESSORS_CONF);
+	if (rb->ncores > MAX_CPUS)
+		rb->ncores = MAX_CPUS;
+	rb->epochs = aligned_alloc(CACHE_LINE, rb->ncores * sizeof(CoreEpoch));
+	memset(rb->epochs, 0, rb->ncores * sizeof(CoreEpoch));
+	pthread_mutex_init(&rb->lock, NULL);
+	pthread_cond_init(&rb->posted, NULL);
+	pthread_cond_init(&rb->published, NULL);
+	set_build_report(0);
+	pthread_create(&rb->thread, NULL, rebuild_thread, rb);
+	return rb;
+}
+
+
+
+// stop the builder; no core may classify any more
+void rebuild_free(Rebuilder *rb)
+{
+	pthread_mutex_lock(&rb->lock);
+	rb->stop = 1;
+	__atomic_store_n(&build_cancel, 1, __ATOMIC_RELAXED);
+	pthread_cond_broadcast(&rb->posted);
+	pthread_cond_broadcast(&rb->published);
+	pthread_mutex_unlock(&rb->lock);
+	pthread_join(rb->thread, NULL);
+	__atomic_store_n(&build_cancel, 0, __ATOMIC_RELAXED);
+
+	version_retire(rb, &rb->slot[0]);
+	version_retire(rb, &rb->slot[1]);
+	free(rb->next);
+	free(rb->epochs);
+	pthread_mutex_destroy(&rb->lock);
+	pthread_cond_destroy(&rb->posted);
+	pthread_cond_destroy(&rb->published);
+	free(rb);
+}
+
+
+
+// queue the rule file for a rebuild and return at once with its sequence number; a post not
+// started yet is dropped, and one being built is cancelled
+uint32_t rebuild_post(Rebuilder *rb, char *path)
+{
+	uint32_t	seq;
+
+	pthread_mutex_lock(&rb->lock);
+	free(rb->next);
+	rb->next = strdup(path);
+	seq = ++rb->next_seq;
+	clock_gettime(CLOCK_MONOTONIC, &rb->posted_at);
+	__atomic_store_n(&build_cancel, 1, __ATOMIC_RELAXED);
+	pthread_cond_signal(&rb->posted);
+	pthread_mutex_unlock(&rb->lock);
+	return seq;
+}
+
+
+
+// block until the post seq, or a later one, is done with; return 1 if it is live
+int rebuild_wait(Rebuilder *rb, uint32_t seq)
+{
+	int		live;
+
+	pthread_mutex_lock(&rb->lock);
+	while (rb->done_seq < seq && !rb->stop)
+		pthread_cond_wait(&rb->published, &rb->lock);
+	live = rb->live_seq >= seq;
+	pthread_mutex_unlock(&rb->lock);
+	return live;
+}
+
+
+
+// the live version for a batch of lookups on core, NULL before the first publish; the core
+// stays on it until rebuild_release()
+inline Version* rebuild_acquire(Rebuilder *rb, int core)
+{
+	Version		*v;
+	uint32_t	seq;
+
+	// the slots are reused: v is still live with the version of the epoch stored only if its
+	// seq did not change either
+	do {
+		if ((v = __atomic_load_n(&rb->live, __ATOMIC_SEQ_CST)) == NULL)
+			return NULL;
+		seq = __atomic_load_n(&v->seq, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&rb->epochs[core].seq, seq, __ATOMIC_SEQ_CST);
+	} while (__atomic_load_n(&rb->live, __ATOMIC_SEQ_CST) != v ||
+			__atomic_load_n(&v->seq, __ATOMIC_SEQ_CST) != seq);
+	return v;
+}
+
+
+
+inline void rebuild_release(Rebuilder *rb, int core)
+{
+	__atomic_store_n(&rb->epochs[core].seq, 0, __ATOMIC_RELEASE);
+}
+
+
+
+void rebuild_report(Rebuilder *rb)
+{
+	pthread_mutex_lock(&rb->lock);
+	printf("rebuild: %lu builds, %lu cancelled, %lu published; last: parse %.1f ms, reduce %.1f ms, "
+			"build %.1f ms, flatten %.1f ms; longest post to publish %.1f ms\n",
+			rb->builds, rb->cancels, rb->publishes, rb->stage_ms[0], rb->stage_ms[1],
+			rb->stage_ms[2], rb->stage_ms[3], rb->max_post_ms);
+	pthread_mutex_unlock(&rb->lock);
+}
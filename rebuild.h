@@ -0,0 +1,63 @@
+#ifndef REBUILD_H
+#define REBUILD_H
+
+#include <pthread.h>
+#include "classifier.h"
+
+
+// rule set version through the pipeline: parsed, reduced, built and flattened into a
+// classifier, then published
+typedef struct {
+	uint32_t	seq;			// order it was posted in
+	Rule		*rules;			// the classifier's rules point here
+	int			nrules;
+	Classifier	*c;
+} Version;
+
+// sequence number a core is classifying on, alone on its cache line; 0 when idle
+typedef struct {
+	uint32_t	seq;
+} __attribute__((aligned(CACHE_LINE))) CoreEpoch;
+
+// background rebuild of posted rule files on a builder thread. The classifier in use is
+// double buffered: a new version is flattened and published while lookups run on the live
+// one, and the version before that is freed once no core is on it. A post made during a
+// build cancels it; the newest post is built next.
+typedef struct {
+	pthread_t		thread;
+	pthread_mutex_t	lock;
+	pthread_cond_t	posted;			// to the builder: a new post, or stop
+	pthread_cond_t	published;		// to rebuild_wait(): a version is live
+	char			*next;			// newest rule file posted, NULL when built
+	uint32_t		next_seq;
+	uint32_t		live_seq;		// the newest published post
+	uint32_t		done_seq;		// the newest post published or failed
+	int				stop;
+	Version			slot[2];		// the live version and the one before it
+	Version			*live;			// what rebuild_acquire() returns
+	CoreEpoch		*epochs;		// per core
+	int				ncores;
+
+	int				leaf_rules, reduce, order, top_levels, huge;
+	void			(*notify)(Version *v, void *arg);	// called by the builder on publish
+	void			*notify_arg;
+
+	// counters, read with rebuild_report()
+	uint64_t		builds, cancels, publishes;
+	double			stage_ms[4];	// of the last publish: parse, reduce, build, flatten
+	double			max_post_ms;	// longest from a post to its publish
+	struct timespec	posted_at;
+} Rebuilder;
+
+
+Rebuilder* rebuild_new(int leaf_rules, int reduce, int order, int top_levels, int huge);
+void rebuild_free(Rebuilder *rb);
+uint32_t rebuild_post(Rebuilder *rb, char *path);
+int rebuild_wait(Rebuilder *rb, uint32_t seq);
+inline
+Version* rebuild_acquire(Rebuilder *rb, int core);
+inline
+void rebuild_release(Rebuilder *rb, int core);
+void rebuild_report(Rebuilder *rb);
+
+#endif
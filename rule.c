@@ -1,9 +1,24 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "rule.h"
 
 
 
+// priority order of the loaded rules: the priority column, then the line
+int cmp_rule_order(const void *a, const void *b)
+{
+	Rule	*x = (Rule *) a, *y = (Rule *) b;
+
+	if (x->priority != y->priority)
+		return x->priority < y->priority ? -1 : 1;
+	return x->line - y->line;
+}
+
+
+
+// load the rules in classbench format, sorted by priority (stable in line order) and numbered
+// in that order, which is the one first-match follows
 int loadrules(FILE *fp, Rule **ruleset)
 {
 	uint32_t 	sip1, sip2, sip3, sip4, sprefix;
@@ -14,20 +29,30 @@ int loadrules(FILE *fp, Rule **ruleset)
 	uint32_t	ip, mask;
 	Rule		*rule, *rules;
 	int 		num_rules = 0, ruleset_size = 1024;//number of rules
+	char		line[256];
+	int			n;
 
 	rules = (Rule *) malloc(ruleset_size * sizeof(Rule));
 
-	while (1) {
+	while (fgets(line, sizeof(line), fp) != NULL) {
 		rule = &(rules[num_rules]);
-		if (fscanf(fp,"@%d.%d.%d.%d/%d\t%d.%d.%d.%d/%d\t%d : %d\t%d : %d\t%x/%x\n", 
+		n = sscanf(line, "@%d.%d.%d.%d/%d\t%d.%d.%d.%d/%d\t%d : %d\t%d : %d\t%x/%x %d %d",
 					&sip1, &sip2, &sip3, &sip4, &sprefix,
 					&dip1, &dip2, &dip3, &dip4, &dprefix, 
 					&(rule->field[2].lo), &(rule->field[2].hi),
 					&(rule->field[3].lo), &(rule->field[3].hi),
-					&prot, &prot_prefix) != 16) 
+					&prot, &prot_prefix, &(rule->action), &(rule->priority));
+		if (n < 16)
 			break;
+		if (n < 17)
+			rule->action = 0;
+		if (n < 18)
+			rule->priority = num_rules;
 //printf("num_rules:%d\n", num_rules);		
 		rule->id = num_rules;
+		rule->line = num_rules;
+		rule->prefix[0] = sprefix;
+		rule->prefix[1] = dprefix;
 		// source ip
 		if (sprefix == 0) {
 			rule->field[0].lo = 0;
@@ -75,12 +100,254 @@ int loadrules(FILE *fp, Rule **ruleset)
 		}
 	}
 
+	qsort(rules, num_rules, sizeof(Rule), cmp_rule_order);
+	for (n = 0; n < num_rules; n++)
+		rules[n].id = n;
 	*ruleset = (Rule *) realloc(rules, num_rules * sizeof(Rule));
 	return num_rules;
 }
 
 
 
+// load packet headers in classbench trace format: sip dip sp dp proto [filter]
+int loadtrace(FILE *fp, Packet **trace)
+{
+	Packet		*pkt, *packets;
+	int			num_packets = 0, trace_size = 1024;
+	char		line[256];
+
+	packets = (Packet *) malloc(trace_size * sizeof(Packet));
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		pkt = &(packets[num_packets]);
+		if (sscanf(line, "%u %u %u %u %u",
+					&(pkt->field[0]), &(pkt->field[1]), &(pkt->field[2]),
+					&(pkt->field[3]), &(pkt->field[4])) != 5)
+			continue;
+
+		num_packets++;
+		if (num_packets >= trace_size) {
+			trace_size <<= 1;
+			packets = (Packet *) realloc(packets, trace_size * sizeof(Packet));
+		}
+	}
+
+	*trace = (Packet *) realloc(packets, num_packets * sizeof(Packet));
+	return num_packets;
+}
+
+
+
+/******************************************************************************
+ *
+ * Section for rule set reduction before building
+ *
+ *****************************************************************************/
+
+// whether a covers b on all fields
+int rule_cover(Rule *a, Rule *b)
+{
+	int		dim;
+
+	for (dim = 0; dim < NFIELDS; dim++) {
+		if (!range_cover(a->field[dim], b->field[dim]))
+			return 0;
+	}
+	return 1;
+}
+
+
+
+// slot of the prefix pair (v0/b0, v1/b1) in a hash table of rule indices, empty if not found
+int prefix_slot(int *table, int tsize, Rule *rules, uint32_t v0, int b0, uint32_t v1, int b1)
+{
+	int		h, j;
+
+	for (h = hull_hash(v0, b0, v1, b1) & (tsize - 1); table[h] != -1; h = (h + 1) & (tsize - 1)) {
+		j = table[h];
+		if (range_hull(rules[j].field[0]) == b0 && (rules[j].field[0].lo & prefix_mask(b0)) == v0 &&
+				range_hull(rules[j].field[1]) == b1 && (rules[j].field[1].lo & prefix_mask(b1)) == v1)
+			break;
+	}
+	return h;
+}
+
+
+
+// drop the rules covered by a single earlier rule, they can never match. Earlier rules are
+// indexed by their ip prefix pair, a cover of rule i has an ancestor pair of the prefixes of i
+// among the prefix lengths present. Return #rules left
+int remove_shadowed(Rule *rules, int nrules)
+{
+	int			*table, *next, tsize, i, j, h, b0, b1, n = 0;
+	uint64_t	lens[2] = {0, 0}, m0, m1;
+	uint32_t	v0, v1;
+	Rule		*r;
+
+	for (tsize = 16; tsize < 2 * nrules; tsize *= 2)
+		;
+	table = malloc(tsize * sizeof(int));
+	next = malloc(nrules * sizeof(int));
+	memset(table, -1, tsize * sizeof(int));
+	for (i = 0; i < nrules; i++) {
+		lens[0] |= 1UL << range_hull(rules[i].field[0]);
+		lens[1] |= 1UL << range_hull(rules[i].field[1]);
+	}
+
+	for (i = 0; i < nrules; i++) {
+		r = &rules[i];
+		for (m0 = lens[0] & ((2UL << range_hull(r->field[0])) - 1); m0 != 0; m0 &= ~(1UL << b0)) {
+			b0 = 63 - __builtin_clzl(m0);
+			v0 = r->field[0].lo & prefix_mask(b0);
+			for (m1 = lens[1] & ((2UL << range_hull(r->field[1])) - 1); m1 != 0; m1 &= ~(1UL << b1)) {
+				b1 = 63 - __builtin_clzl(m1);
+				v1 = r->field[1].lo & prefix_mask(b1);
+				h = prefix_slot(table, tsize, rules, v0, b0, v1, b1);
+				for (j = table[h]; j != -1; j = next[j]) {
+					if (rule_cover(&rules[j], r))
+						goto shadowed;
+				}
+			}
+		}
+
+		// keep rule i at n and index it under its own prefix pair
+		rules[n] = *r;
+		b0 = range_hull(rules[n].field[0]);
+		b1 = range_hull(rules[n].field[1]);
+		h = prefix_slot(table, tsize, rules, rules[n].field[0].lo & prefix_mask(b0), b0,
+				rules[n].field[1].lo & prefix_mask(b1), b1);
+		next[n] = table[h];
+		table[h] = n;
+		n++;
+shadowed:
+		;
+	}
+
+	free(table);
+	free(next);
+	return n;
+}
+
+
+
+// the union of two ranges when it is one range (a prefix on the ip and protocol fields)
+int range_merge(Range *u, Range a, Range b, int dim)
+{
+	uint32_t	size;
+
+	if ((uint64_t) a.hi + 1 < b.lo || (uint64_t) b.hi + 1 < a.lo)
+		return 0;
+	u->lo = a.lo < b.lo ? a.lo : b.lo;
+	u->hi = a.hi > b.hi ? a.hi : b.hi;
+	size = u->hi - u->lo;
+	if ((dim == 0 || dim == 1 || dim == 4) && ((size & (size + 1)) != 0 || (u->lo & size) != 0))
+		return 0;
+	return 1;
+}
+
+
+
+// merge each rule into the previous one when they have the same action and differ in one field
+// only, where the union is one range: the later rule gains no priority over any rule in between.
+// Return #rules left
+int merge_adjacent(Rule *rules, int nrules)
+{
+	Range	u;
+	int		i, dim, diff, n = 0;
+
+	for (i = 0; i < nrules; i++) {
+		if (n > 0 && rules[n-1].action == rules[i].action) {
+			for (dim = 0, diff = -1; dim < NFIELDS; dim++) {
+				if (rules[n-1].field[dim].lo == rules[i].field[dim].lo &&
+						rules[n-1].field[dim].hi == rules[i].field[dim].hi)
+					continue;
+				if (diff >= 0)
+					break;
+				diff = dim;
+			}
+			if (dim == NFIELDS && (diff < 0 || range_merge(&u, rules[n-1].field[diff], rules[i].field[diff], diff))) {
+				// the union keeps the priority of the earlier rule, the higher one
+				if (diff >= 0)
+					rules[n-1].field[diff] = u;
+				if (diff == 0 || diff == 1)
+					rules[n-1].prefix[diff] = range_hull(u);
+				continue;
+			}
+		}
+		rules[n++] = rules[i];
+	}
+	return n;
+}
+
+
+
+// remove the shadowed rules and merge adjacent rules until nothing changes, then renumber the
+// ids densely; the lookups keep their actions. Return #rules left
+int reduce_rules(Rule *rules, int nrules)
+{
+	int		n = nrules, nshadowed = 0, nmerged = 0, start, m, i;
+
+	do {
+		start = m = n;
+		n = remove_shadowed(rules, n);
+		nshadowed += m - n;
+		m = n;
+		n = merge_adjacent(rules, n);
+		nmerged += m - n;
+	} while (n < start);
+
+	for (i = 0; i < n; i++)
+		rules[i].id = i;
+	printf("reduce: %d rules, %d shadowed, %d merged, %d left\n", nrules, nshadowed, nmerged, n);
+	return n;
+}
+
+
+
+int match_rule(Rule *rule, Packet *pkt)
+{
+	int		dim;
+
+	for (dim = 0; dim < NFIELDS; dim++) {
+		if (pkt->field[dim] < rule->field[dim].lo || pkt->field[dim] > rule->field[dim].hi)
+			return 0;
+	}
+	return 1;
+}
+
+
+
+// reference classification: the first (highest priority) matching rule
+Rule* linear_classify(Rule *rules, int nrules, Packet *pkt)
+{
+	int		i;
+
+	for (i = 0; i < nrules; i++) {
+		if (match_rule(&rules[i], pkt))
+			return &rules[i];
+	}
+	return NULL;
+}
+
+
+
+// reference multi-match: all matching rules in rule order, up to max stored; return how many
+int linear_classify_all(Rule *rules, int nrules, Packet *pkt, Rule **matches, int max)
+{
+	int		i, n = 0;
+
+	for (i = 0; i < nrules; i++) {
+		if (match_rule(&rules[i], pkt)) {
+			if (n < max)
+				matches[n] = &rules[i];
+			n++;
+		}
+	}
+	return n;
+}
+
+
+
 // dump rules in classbench format
 void dump_rule(Rule *rule)
 {
@@ -9,10 +9,26 @@
 typedef struct {
 	int			id;
 	Range		field[NFIELDS];
+	int			action;		// optional column after the protocol, 0 by default
+	int			priority;	// optional column after the action, lower first; the line by default.
+							// loadrules() sorts by it, so the ids follow it
+	int			line;		// position in the rule file, ids are renumbered by reduce_rules()
+	uint8_t		prefix[2];	// prefix lengths of the ip fields
 } Rule;
 
 
+typedef struct {
+	uint32_t	field[NFIELDS];
+} Packet;
+
+
 int loadrules(FILE *fp, Rule **rules);
+int loadtrace(FILE *fp, Packet **packets);
+int reduce_rules(Rule *rules, int nrules);
+int match_rule(Rule *rule, Packet *pkt);
+Rule* linear_classify(Rule *rules, int nrules, Packet *pkt);
+int linear_classify_all(Rule *rules, int nrules, Packet *pkt, Rule **matches, int max);
+void dump_rule(Rule *rule);
 void dump_ruleset();
 
 #endif
@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "tenant.h"
+
+
+#define RULE_KEY_BYTES	(offsetof(Rule, priority) - offsetof(Rule, field))	// fields and action
+
+enum { STORE_RULE, STORE_LIST, STORE_POINTS, STORE_NODES };
+
+
+
+/******************************************************************************
+ *
+ * Section for the content-addressed store
+ *
+ ******************************************************************************/
+
+
+void* store_alloc(TenantSet *ts, size_t bytes)
+{
+	Arena	*a = ts->narenas > 0 ? ts->arenas[ts->narenas-1] : NULL;
+
+	if (a == NULL || a->used + bytes > a->size) {
+		a = arena_new(bytes > STORE_CHUNK ? bytes : STORE_CHUNK, ts->huge);
+		if (a == NULL) {
+			fprintf(stderr, "Failed to map the tenant store\n");
+			exit(1);
+		}
+		ts->arenas = realloc(ts->arenas, (ts->narenas + 1) * sizeof(Arena *));
+		ts->arenas[ts->narenas++] = a;
+	}
+	return arena_alloc(a, bytes);
+}
+
+
+
+uint64_t store_hash(void *p, uint32_t len, int kind)
+{
+	uint32_t	*w = p;
+	uint64_t	h = len * 31 + kind;
+	int			i;
+
+	for (i = 0; i < len / 4; i++)
+		h = (h ^ w[i]) * 0x100000001B3ULL;
+	return h ^ h >> 29;
+}
+
+
+
+void store_grow(TenantSet *ts)
+{
+	StoreEntry	*old = ts->table, *e;
+	uint32_t	size = ts->table_size, i;
+
+	ts->table_size = size > 0 ? size * 2 : 1024;
+	ts->table = calloc(ts->table_size, sizeof(StoreEntry));
+	for (i = 0; i < size; i++) {
+		if (old[i].p == NULL)
+			continue;
+		for (e = &ts->table[old[i].hash & (ts->table_size - 1)]; e->p != NULL; )
+			e = e == &ts->table[ts->table_size - 1] ? ts->table : e + 1;
+		*e = old[i];
+	}
+	free(old);
+}
+
+
+
+// the slot of the stored object of kind equal to the len bytes at key, an empty slot with
+// the hash set when there is none
+StoreEntry* store_slot(TenantSet *ts, void *key, uint32_t len, int kind)
+{
+	StoreEntry	*e;
+	uint64_t	hash = store_hash(key, len, kind);
+
+	if (2 * (ts->nentries + 1) > ts->table_size)
+		store_grow(ts);
+	for (e = &ts->table[hash & (ts->table_size - 1)]; e->p != NULL; ) {
+		if (e->hash == hash && e->len == len && memcmp(e->p, key, len) == 0)
+			return e;
+		e = e == &ts->table[ts->table_size - 1] ? ts->table : e + 1;
+	}
+	e->hash = hash;
+	e->len = len;
+	return e;
+}
+
+
+
+// the stored copy of the len bytes at p
+void* intern(TenantSet *ts, void *p, uint32_t len, int kind)
+{
+	StoreEntry	*e = store_slot(ts, p, len, kind);
+
+	ts->bytes_added += len;
+	if (e->p != NULL)
+		return e->p;
+	e->p = store_alloc(ts, len);
+	memcpy(e->p, p, len);
+	ts->nentries++;
+	ts->bytes_stored += len;
+	if (kind == STORE_NODES)
+		ts->nodes_stored += len / sizeof(Trie);
+	return e->p;
+}
+
+
+
+/******************************************************************************
+ *
+ * Section for the tenant tries
+ *
+ ******************************************************************************/
+
+
+// the pooled rule equal to rule in its fields and action, the first one pooled keeps its
+// priority and line
+Rule* pool_rule(TenantSet *ts, Rule *rule)
+{
+	StoreEntry	*e = store_slot(ts, rule->field, RULE_KEY_BYTES, STORE_RULE);
+	TBits		tbits[MAX_RANGE_TBITS];
+	BandRule	*brule;
+	Rule		*r;
+	int			dim, n;
+
+	ts->bytes_added += sizeof(Rule);
+	if (e->p != NULL)
+		return (Rule *) ((char *) e->p - offsetof(Rule, field));
+
+	r = store_alloc(ts, sizeof(Rule));
+	*r = *rule;
+	r->id = ts->nrules;
+	e->p = r->field;
+	ts->nentries++;
+	ts->bytes_stored += sizeof(Rule);
+
+	if (ts->nrules == ts->rules_size) {
+		ts->rules_size = ts->rules_size > 0 ? ts->rules_size * 2 : 1024;
+		ts->rules = realloc(ts->rules, ts->rules_size * sizeof(Rule *));
+		ts->brules = realloc(ts->brules, ts->rules_size * sizeof(BandRule));
+	}
+	ts->rules[r->id] = r;
+	brule = &ts->brules[r->id];
+	brule->rule = r;
+	for (dim = 0; dim < NFIELDS; dim++) {
+		n = range_tbits(tbits, dim, r->field[dim]);
+		brule->ntbits[dim] = n;
+		brule->tbits[dim] = store_alloc(ts, n * sizeof(TBits));
+		memcpy(brule->tbits[dim], tbits, n * sizeof(TBits));
+	}
+	ts->nrules++;
+	return r;
+}
+
+
+
+// the node v of a built trie as stored in w, with what only lookups read and the rules
+// replaced by their pooled ones (map, by rule id); the children arrays are stored bottom up
+// so that equal subtrees end up in the same children array
+void store_node(TenantSet *ts, Trie *v, Trie *w, Rule **map)
+{
+	Trie	children[MAX_CHILDREN];
+	Rule	**rules;
+	int		i;
+
+	memset(w, 0, sizeof(Trie));
+	w->id = -1;
+	w->depth = v->depth;
+	w->type = v->type;
+	w->full_cover = v->full_cover != NULL ? map[v->full_cover->id] : NULL;
+	w->split = v->split;
+	w->present = v->present;
+	w->cindex = v->cindex;
+	if (v->points != NULL)
+		w->points = intern(ts, v->points, POINTS_BYTES, STORE_POINTS);
+	ts->nodes_added++;
+
+	if (v->nchildren > 0) {
+		for (i = 0; i < v->nchildren; i++)
+			store_node(ts, &v->children[i], &children[i], map);
+		w->nchildren = v->nchildren;
+		w->children = intern(ts, children, v->nchildren * sizeof(Trie), STORE_NODES);
+	} else if (v->nrules > 0) {
+		rules = malloc(v->nrules * sizeof(Rule *));
+		for (i = 0; i < v->nrules; i++)
+			rules[i] = map[unpack_leaf(v)[i]->id];
+		w->nrules = v->nrules;
+		w->rules = intern(ts, rules, v->nrules * sizeof(Rule *), STORE_LIST);
+		free(rules);
+	}
+}
+
+
+
+TenantSet* tenants_new(int huge)
+{
+	TenantSet	*ts = calloc(1, sizeof(TenantSet));
+
+	ts->huge = huge;
+	store_grow(ts);
+	return ts;
+}
+
+
+
+void tenants_free(TenantSet *ts)
+{
+	int		i;
+
+	for (i = 0; i < ts->narenas; i++)
+		arena_free(ts->arenas[i]);
+	free(ts->arenas);
+	free(ts->table);
+	free(ts->rules);
+	free(ts->brules);
+	free(ts->roots);
+	free(ts);
+}
+
+
+
+// build the trie of a rule set (ids 0 .. nrules-1) for first-match lookups, move it into the
+// store and free it with the build state; return the tenant id. The rules are not referred to
+// afterwards; pooled, if not NULL, gets the pooled rule of each.
+int tenants_add(TenantSet *ts, Rule *rules, int nrules, int leaf_rules, Rule **pooled)
+{
+	Rule	**map;
+	Trie	*root, w;
+	int		i;
+
+	map = malloc(nrules * sizeof(Rule *));
+	for (i = 0; i < nrules; i++)
+		map[i] = pool_rule(ts, &rules[i]);
+	ts->rules_added += nrules;
+
+	root = build_trie(rules, nrules, leaf_rules);
+	ts->trie_bytes += trie_bytes(root) + band_rules_bytes(band_rules, nrules);
+	store_node(ts, root, &w, map);
+	free_trie(root);
+	build_reset();
+	if (pooled != NULL)
+		memcpy(pooled, map, nrules * sizeof(Rule *));
+	free(map);
+
+	if (ts->ntenants == ts->roots_size) {
+		ts->roots_size = ts->roots_size > 0 ? ts->roots_size * 2 : 64;
+		ts->roots = realloc(ts->roots, ts->roots_size * sizeof(Trie *));
+	}
+	ts->roots[ts->ntenants] = intern(ts, &w, sizeof(Trie), STORE_NODES);
+	return ts->ntenants++;
+}
+
+
+
+inline Rule* tenants_lookup(TenantSet *ts, int tenant, Packet *pkt)
+{
+	Trie	*end;
+
+	return descend(ts->roots[tenant], ts->brules, NULL, pkt, &end);
+}
+
+
+
+// classify the (tenants[i], pkts[i]) pairs into out[i], the root of the next pair fetched
+// while the current one walks
+void tenants_classify(TenantSet *ts, int *tenants, Packet *pkts, int n, Rule **out)
+{
+	Trie	*end;
+	int		i;
+
+	for (i = 0; i < n; i++) {
+		if (i + 1 < n)
+			__builtin_prefetch(ts->roots[tenants[i+1]]);
+		out[i] = descend(ts->roots[tenants[i]], ts->brules, NULL, &pkts[i], &end);
+	}
+}
+
+
+
+size_t tenants_bytes(TenantSet *ts)
+{
+	size_t	bytes = ts->table_size * sizeof(StoreEntry) + ts->rules_size * (sizeof(Rule *) + sizeof(BandRule))
+					+ ts->roots_size * sizeof(Trie *);
+	int		i;
+
+	for (i = 0; i < ts->narenas; i++)
+		bytes += ts->arenas[i]->used;
+	return bytes;
+}
+
+
+
+void tenants_report(TenantSet *ts)
+{
+	printf("tenants: %d, rules %ld pooled into %d, nodes %ld stored as %ld\n",
+			ts->ntenants, ts->rules_added, ts->nrules, ts->nodes_added, ts->nodes_stored);
+	printf("tenant store: %lu bytes (%d arenas, %lu of %lu interned bytes kept), "
+			"%lu bytes as separate tries\n", tenants_bytes(ts), ts->narenas, ts->bytes_stored,
+			ts->bytes_added, ts->trie_bytes);
+}
@@ -0,0 +1,48 @@
+#ifndef TENANT_H
+#define TENANT_H
+
+#include "trie.h"
+#include "layout.h"
+
+#define STORE_CHUNK		(4UL << 20)		// arena size the store grows by
+
+
+typedef struct {
+	uint64_t	hash;
+	void		*p;				// stored bytes, NULL for an empty slot
+	uint32_t	len;
+} StoreEntry;
+
+
+// the tries of many small rule sets in shared arenas. Rules equal in their fields and action
+// are stored once for all tenants, as are equal leaf rule lists, range cut points and child
+// arrays (so equal subtrees). Nodes in the store have no parent and id -1. Adding a tenant
+// must not run together with lookups.
+typedef struct {
+	Trie		**roots;		// per tenant
+	int			ntenants, roots_size;
+	Rule		**rules;		// pooled rules, by id
+	BandRule	*brules;		// pooled rules in ternary form, by id
+	int			nrules, rules_size;
+	Arena		**arenas;
+	int			narenas, huge;
+	StoreEntry	*table;			// every stored object, by content
+	uint32_t	table_size, nentries;
+
+	long		rules_added, nodes_added;	// before dedup
+	long		nodes_stored;
+	size_t		bytes_added, bytes_stored;	// of the interned objects
+	size_t		trie_bytes;		// of the tenant tries as built, one by one
+} TenantSet;
+
+
+TenantSet* tenants_new(int huge);
+void tenants_free(TenantSet *ts);
+int tenants_add(TenantSet *ts, Rule *rules, int nrules, int leaf_rules, Rule **pooled);
+inline
+Rule* tenants_lookup(TenantSet *ts, int tenant, Packet *pkt);
+void tenants_classify(TenantSet *ts, int *tenants, Packet *pkts, int n, Rule **out);
+size_t tenants_bytes(TenantSet *ts);
+void tenants_report(TenantSet *ts);
+
+#endif
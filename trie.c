@@ -1,30 +1,73 @@
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#include <limits.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "trie.h"
+#include "adapt.h"
+#include "perfctr.h"
 
 #define		NODES_CHUNK		8192
-#define		REDUN_NRULES	256		// don't check rule redundancy if #rules > it
-#define		REDUN_NCHECK	16		// only check at most this number of redundant candidates
+#define		REDUN_NCHECK	64		// at most this number of redundant candidates per rule
+#define		REDUN_NSCAN		256		// at most this number of hull chain entries examined per rule
 #define		EFFI_LEVEL		8		// 0: max child rules <= 1/8, 7: max child rules > 7/8
+#define		LEAF_BINS		8		// leaf sizes of dump_quality(): 0, 1, 2-3, .., 64 and more
+#define		CUT_SAMPLES		8192	// max #sampled packets for the traffic objective
+#define		SIGN_BIAS		0x80000000U	// unsigned order as signed order for SSE compares
 
 
 // data structures for statistics
 int		total_nodes, leaf_nodes, max_depth, trie_nodes_size;
 int		depth_nodes[MAX_DEPTH], depth_leaf_nodes[MAX_DEPTH], depth_max_node[MAX_DEPTH];
 int		cut_efficiency[MAX_DEPTH][EFFI_LEVEL];
+double	cut_score_sum[MAX_DEPTH];	// sum of the chosen cut scores per depth
+int		cut_nodes[MAX_DEPTH];		// #nodes choosing a cut per depth
 int		*rule_duplicates;
+long	cuts_tried, rules_pruned, nodes_dedup;	// build counters for dump_json()
+int		select_pruned;				// #redundant rules dropped by the last select_rules()
+int		*select_pruners;			// the parent index of the rule covering each of them
+double	build_seconds;
+LookupStats	lookup_stats;
 
 int		total_rules, LEAF_RULES;
 Trie	*root_node, **trie_nodes, *max_depth_leaf;
 
+double	score_minmax(Trie *v, CutStat *st);
+CutScore	cut_score = score_minmax;	// scoring function of choose_cut()
+char	*cut_objective = "minmax";
+double	cut_weight;
+BandRule	*band_rules;		// rules in ternary form for matching, indexed by rule id
+int		multi_match;			// build for lookup_multi(): no pruning, cover lists
+int		keep_pruners;			// record the pruners of each node, for the rule updates
+int		build_report = 1;		// dump the nodes and statistics at the end of build_trie()
+int		build_cancel;			// set to give up the build_trie() running; it returns a partial trie
+
+// packed leaves: rule ids in a pool of shared lists, matched against a dense copy of the rules
+LeafPool	leaf_pool;			// of the built trie, by pack_leaves()
+uint32_t	trie_generation;	// bumped when a trie is built, rebuilt or swapped
+
 // data structures for dfs based trie construction
 Band	dfs_cuts[MAX_DEPTH];
 int		dfs_uncuts[MAX_DEPTH][NFIELDS];	// field bands not cut yet
+Range	dfs_bounds[MAX_DEPTH][NFIELDS];	// space of the node at each depth, in stripped form
+uint32_t	dfs_points[MAX_DEPTH][RANGE_POINTS];	// points of a range cut at each depth
 Rule	*dfs_rules_strip[MAX_DEPTH][BAND_SIZE];
-int		dfs_rule_redun[MAX_DEPTH][REDUN_NRULES][REDUN_NCHECK];
+// redundancy candidates of the rules of the node at each depth, rule i has the candidates
+// dfs_redun[depth][dfs_redun_first[depth][i] .. dfs_redun_first[depth][i+1]-1]
+int		*dfs_redun[MAX_DEPTH], dfs_redun_size[MAX_DEPTH], *dfs_redun_first[MAX_DEPTH];
+
+// hash index of the rules of a node by the prefix hulls of their ip fields, see calc_rule_redun()
+int			*hull_table, *hull_next, *hull_bits[2], hull_table_size;
+uint32_t	*hull_val[2];
 
 int		*rule_map_p2c, *rule_map_c2p;	// mapping rule order between parent and child
 
+// sampled packets for traffic-weighted cut decision, stripped along the path as the rules
+Packet	*cut_samples, *dfs_pkts_strip[MAX_DEPTH][BAND_SIZE];
+int		num_cut_samples, dfs_npkts[MAX_DEPTH][BAND_SIZE];
+
 
 
 
@@ -35,84 +78,246 @@ int		*rule_map_p2c, *rule_map_c2p;	// mapping rule order between parent and chil
  *****************************************************************************/
 
 
-// check rule redundancy by efficiently comparing with earlier included rules in child
+// child value of a key under a range cut: #points <= key
+inline
+int range_value(uint32_t key, uint32_t *points)
+{
+	int		val = 0, i;
+
+	for (i = 0; i < RANGE_POINTS; i++)
+		val += key >= points[i];
+	return val;
+}
+
+
+
+inline
+int cut_value(uint32_t key, Band *cut, uint32_t *points)
+{
+	if (cut->bid == RANGE_BID)
+		return range_value(key, points);
+	return extract_bits(key, band_msb(cut->bid), band_lsb(cut->bid));
+}
+
+
+
+// the part of a range in the child cut->val, stripped by a band cut or clipped to the interval
+// of a range cut; return 0 when empty
+int cut_range(Range *r, Band *cut, uint32_t *points)
+{
+	uint32_t	lo, hi;
+
+	if (cut->bid != RANGE_BID)
+		return range_strip(r, cut->bid, cut->val);
+	lo = cut->val == 0 ? 0 : points[cut->val-1];
+	hi = cut->val == RANGE_POINTS ? UINT32_MAX : points[cut->val] - 1;
+	if (lo > hi || r->hi < lo || r->lo > hi)
+		return 0;
+	r->lo = r->lo < lo ? lo : r->lo;
+	r->hi = r->hi > hi ? hi : r->hi;
+	return 1;
+}
+
+
+
+int cmp_point(const void *a, const void *b)
+{
+	uint32_t	x = *(uint32_t *) a, y = *(uint32_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+
+
+// the distinct ends of the rule ranges on dim inside v, sorted into a malloc'ed array: the
+// start of each range and the value past it. *m is set to their number
+uint32_t* range_ends(Trie *v, int dim, int *m)
+{
+	Rule		*rules = dfs_rules_strip[v->depth][v->cut.val];
+	Range		b = dfs_bounds[v->depth][dim], *r;
+	uint32_t	*ends = malloc(2 * v->nrules * sizeof(uint32_t));
+	int			i, n = 0;
+
+	for (i = 0; i < v->nrules; i++) {
+		r = &rules[i].field[dim];
+		if (r->lo > b.lo)
+			ends[n++] = r->lo;
+		if (r->hi < b.hi)
+			ends[n++] = r->hi + 1;
+	}
+	qsort(ends, n, sizeof(uint32_t), cmp_point);
+	for (i = 0, *m = 0; i < n; i++) {
+		if (*m == 0 || ends[i] != ends[*m-1])
+			ends[(*m)++] = ends[i];
+	}
+	return ends;
+}
+
+
+
+// points of a range cut on dim of v: the ends of the rule ranges inside the node, thinned out
+// evenly to at most RANGE_POINTS, so that the children are elementary intervals or runs of
+// them instead of band slices replicating the ranges. Return #points, 0 when nothing to cut
+int range_points(Trie *v, int dim, uint32_t *points)
+{
+	uint32_t	*ends;
+	int			i, m;
+
+	ends = range_ends(v, dim, &m);
+	for (i = 0; i < RANGE_POINTS; i++) {
+		if (m <= RANGE_POINTS)
+			points[i] = i < m ? ends[i] : UINT32_MAX;
+		else
+			points[i] = ends[(long) (i + 1) * m / MAX_CHILDREN];
+	}
+	free(ends);
+	return m < RANGE_POINTS ? m : RANGE_POINTS;
+}
+
+
+
+// check rule redundancy by efficiently comparing with earlier included rules in child; return
+// the parent index of the earlier rule containing it, -1 if none
 int check_rule_redun(Range *r0, Rule *rules_child, int rid_parent, Band *cut, int depth)
 {
-	int				rid_p, rid_c, i, k = 0;
-	Range			r1;
-	int				*redun_list = dfs_rule_redun[depth][rid_parent];
+	int		rid_p, rid_c, i;
+	Range	r1;
+	int		*redun_list = dfs_redun[depth];
 
-	for (i = 0; i < REDUN_NCHECK; i++) {
-		if ((rid_p = redun_list[i]) == -1)
-			break;
+	for (i = dfs_redun_first[depth][rid_parent]; i < dfs_redun_first[depth][rid_parent+1]; i++) {
+		rid_p = redun_list[i];
 		if ((rid_c = rule_map_p2c[rid_p]) == -1)
 			continue;
 		r1 = rules_child[rid_c].field[cut->dim];
 		if (range_cover(r1, *r0))
-			return 1;	// redundant! as it is contained by an earlier rule
+			return rid_p;	// redundant! as it is contained by an earlier rule
 	}
-	return 0;
+	return -1;
 }
 
 
 
-// select rules from parent that overlap with the cut space, check rule redundancy only for
-// nodes with #rules < REDUN_NRULES. both parent and child rules are in stripped forms
+// select rules from parent that overlap with the cut space, dropping the rules covered by an
+// earlier rule in the child. both parent and child rules are in stripped forms
 int select_rules(Rule *rules_parent, Rule *rules_child, int nrules_parent, Band *cut, int depth)
 {
-	int		nrules_child = 0, is_redun, i;
+	int		nrules_child = 0, cover, i;
 	Range	*range;
+	PROF_START(PROF_SELECT_RULES);
 
+	select_pruned = 0;
 	for (i = 0; i < nrules_parent; i++) {
 		rule_map_p2c[i] = -1;
 		rules_child[nrules_child] = rules_parent[i];
 		range = &rules_child[nrules_child].field[cut->dim];
-		if(range_strip(range, cut->bid, cut->val) == 0)
+		if(cut_range(range, cut, dfs_points[depth]) == 0)
 			continue;
-		if (nrules_parent > REDUN_NRULES || nrules_child == 0)
-			is_redun = 0;
+		if (nrules_child == 0 || multi_match)
+			cover = -1;
 		else
-			is_redun = check_rule_redun(range, rules_child, i, cut, depth);
-		if (!is_redun) {
+			cover = check_rule_redun(range, rules_child, i, cut, depth);
+		if (cover < 0) {
 			rule_map_p2c[i] = nrules_child;
 			rule_map_c2p[nrules_child] = i;
 			nrules_child++;
+		} else {
+			select_pruners[select_pruned++] = cover;
 		}
 	}
+	PROF_STOP(PROF_SELECT_RULES);
 	return nrules_child;
 }
 
 
 
-// for each rule in v, get a list of earlier rules which might be candidate of redundant rules
-// to this one, this list is used to speed up rule redundancy check process (a full computation
-// on all five fields and scan through all earlier rules for every cut value is very inefficient)
+// rule j < i can only cover rule i on an ip field if the prefix hull of j contains the hull of
+// i. The rules are indexed by the pair of their ip hulls (the cut field counts as a wildcard);
+// the candidates of i are found by looking up the ancestor pairs of its hulls among the hull
+// lengths present in the node, then checked on the other fields. At most REDUN_NSCAN rules
+// are examined per rule, so the cost is linear in #rules for a bounded number of lengths.
 void calc_rule_redun(Trie *v, Band *cut)
 {
-	Rule	*rules = dfs_rules_strip[v->depth][v->cut.val];
-	Rule	*ri, *rj;
-	int		i, j, dim, nredun;
-	
-	for (i = 1; i < v->nrules; i++) {
+	Rule		*rules = dfs_rules_strip[v->depth][v->cut.val];
+	Rule		*ri, *rj;
+	uint64_t	lens[2] = {0, 0}, m0, m1;
+	uint32_t	val0, val1;
+	int			*first = dfs_redun_first[v->depth], *redun = dfs_redun[v->depth];
+	int			i, j, d, dim, bits0, bits1, nredun, nscan, n = 0, tsize, h;
+
+	if (multi_match)
+		return;		// all matching rules are kept
+	PROF_START(PROF_CALC_RULE_REDUN);
+
+	for (tsize = 16; tsize < 2 * v->nrules; tsize *= 2)
+		;
+	memset(hull_table, -1, tsize * sizeof(int));
+
+	for (i = 0; i < v->nrules; i++) {
+		for (d = 0; d < 2; d++) {
+			hull_bits[d][i] = d == cut->dim ? 0 : range_hull(rules[i].field[d]);
+			hull_val[d][i] = rules[i].field[d].lo & prefix_mask(hull_bits[d][i]);
+			lens[d] |= 1UL << hull_bits[d][i];
+		}
+	}
+
+	for (i = 0; i < v->nrules; i++) {
 		ri = &rules[i];
-		nredun = 0;
-		for (j = i-1; j >= 0; j--) {
-			rj = &rules[j];
-			for (dim = 0; dim < NFIELDS; dim++) {
-				if (dim == cut->dim)
-					continue;
-				if (!range_cover(rj->field[dim], ri->field[dim]))
-					break;
-			}
-			if (dim == NFIELDS) {
-				dfs_rule_redun[v->depth][i][nredun++] = j;
-				if (nredun == REDUN_NCHECK)
-					break;
+		first[i] = n;
+		nredun = nscan = 0;
+		// ancestor hulls of rule i, longest first: the nearest candidates are tried first
+		for (m0 = lens[0] & ((2UL << hull_bits[0][i]) - 1); m0 != 0 && nredun < REDUN_NCHECK &&
+				nscan < REDUN_NSCAN; m0 &= ~(1UL << bits0)) {
+			bits0 = 63 - __builtin_clzl(m0);
+			val0 = hull_val[0][i] & prefix_mask(bits0);
+			for (m1 = lens[1] & ((2UL << hull_bits[1][i]) - 1); m1 != 0 && nredun < REDUN_NCHECK &&
+					nscan < REDUN_NSCAN; m1 &= ~(1UL << bits1)) {
+				bits1 = 63 - __builtin_clzl(m1);
+				val1 = hull_val[1][i] & prefix_mask(bits1);
+				h = hull_hash(val0, bits0, val1, bits1) & (tsize - 1);
+				for (; hull_table[h] != -1; h = (h + 1) & (tsize - 1)) {
+					j = hull_table[h];
+					if (hull_bits[0][j] == bits0 && hull_val[0][j] == val0 &&
+							hull_bits[1][j] == bits1 && hull_val[1][j] == val1)
+						break;
+				}
+				// the rules of a hull pair are chained from the latest one; a popular pair
+				// (0/0 by 0/0) is only walked so far
+				for (j = hull_table[h]; j != -1 && nredun < REDUN_NCHECK && nscan < REDUN_NSCAN;
+						j = hull_next[j]) {
+					nscan++;
+					rj = &rules[j];
+					for (dim = 0; dim < NFIELDS; dim++) {
+						if (dim == cut->dim)
+							continue;
+						if (!range_cover(rj->field[dim], ri->field[dim]))
+							break;
+					}
+					if (dim < NFIELDS)
+						continue;
+					if (n >= dfs_redun_size[v->depth]) {
+						dfs_redun_size[v->depth] = 2 * n + 1024;
+						redun = dfs_redun[v->depth] =
+							realloc(redun, dfs_redun_size[v->depth] * sizeof(int));
+					}
+					redun[n++] = j;
+					nredun++;
+				}
 			}
 		}
-		if (nredun < REDUN_NCHECK)
-			dfs_rule_redun[v->depth][i][nredun] = -1;	// the end of redundant candidates
+
+		// index rule i under its own hull pair for the later rules
+		h = hull_hash(hull_val[0][i], hull_bits[0][i], hull_val[1][i], hull_bits[1][i]) & (tsize - 1);
+		for (; hull_table[h] != -1; h = (h + 1) & (tsize - 1)) {
+			j = hull_table[h];
+			if (hull_bits[0][j] == hull_bits[0][i] && hull_val[0][j] == hull_val[0][i] &&
+					hull_bits[1][j] == hull_bits[1][i] && hull_val[1][j] == hull_val[1][i])
+				break;
+		}
+		hull_next[i] = hull_table[h];
+		hull_table[h] = i;
 	}
+	first[v->nrules] = n;
+	PROF_STOP(PROF_CALC_RULE_REDUN);
 }
 
 
@@ -124,60 +329,400 @@ void calc_rule_redun(Trie *v, Band *cut)
  *****************************************************************************/
 
 
-int try_cut(Trie *v, Band *cut, int *total_rules)
+// lexicographic on the largest child, then the total rules of all children
+double score_minmax(Trie *v, CutStat *st)
+{
+	return st->max_rules + (double) st->total_rules / (v->nrules * BAND_SIZE + 1);
+}
+
+
+
+// weighted memory vs. depth: memory is the bytes of rule lists and nodes created by the cut,
+// depth is how much the largest child shrinks, both relative to the node
+double score_memory(Trie *v, CutStat *st)
+{
+	double	mem, depth;
+
+	mem = st->total_rules * sizeof(Rule *) + st->nchildren * sizeof(Trie);
+	mem /= (double) v->nrules * sizeof(Rule *) * BAND_SIZE;
+	depth = (double) st->max_rules / v->nrules;
+	return cut_weight * mem + (1 - cut_weight) * depth;
+}
+
+
+
+// bits of information of the cut: entropy of the children minus the replication (in bits),
+// a cut copying all rules into all children gains nothing
+double score_entropy(Trie *v, CutStat *st)
+{
+	return log2((double) st->total_rules / v->nrules) - st->entropy;
+}
+
+
+
+// expected #rules left for a packet after the cut, weighted by the sampled traffic; nodes no
+// sampled packet reaches fall back to the minmax objective
+double score_traffic(Trie *v, CutStat *st)
+{
+	if (st->npkts == 0)
+		return score_minmax(v, st);
+	return (double) st->pkt_rules / st->npkts + cut_weight * st->max_rules;
+}
+
+
+
+struct {
+	char		*name;
+	CutScore	score;
+	double		weight;		// default weight
+} cut_objectives[] = {
+	{"minmax",	score_minmax,	0},
+	{"memory",	score_memory,	0.5},
+	{"entropy",	score_entropy,	0},
+	{"traffic",	score_traffic,	0.01},
+	{NULL,		NULL,			0}
+};
+
+
+
+// select the cut objective by name, a negative weight takes its default; return 0 if unknown
+int set_cut_objective(char *name, double weight)
+{
+	int		i;
+
+	for (i = 0; cut_objectives[i].name != NULL; i++) {
+		if (strcmp(cut_objectives[i].name, name) == 0)
+			break;
+	}
+	if (cut_objectives[i].name == NULL)
+		return 0;
+
+	cut_objective = cut_objectives[i].name;
+	cut_score = cut_objectives[i].score;
+	cut_weight = weight < 0 ? cut_objectives[i].weight : weight;
+	return 1;
+}
+
+
+
+// plug in a user defined scoring function
+void set_cut_score(CutScore score)
+{
+	cut_objective = "custom";
+	cut_score = score;
+}
+
+
+
+void set_build_report(int on)
+{
+	build_report = on;
+}
+
+
+
+// build for multi-match lookups: no rule is pruned as redundant, and a rule covering the space
+// of a node goes to the cover list of the node instead of being replicated in the subtree
+void set_multi_match(int on)
+{
+	multi_match = on;
+}
+
+
+
+// keep in each node the rules that dropped a rule from it as covered, so that a rule update
+// knows which lists the deletion of a rule brings a dropped rule back to
+void set_keep_pruners(int on)
+{
+	keep_pruners = on;
+}
+
+
+
+// sample at most CUT_SAMPLES packets evenly from a trace for the traffic objective
+void set_cut_samples(Packet *packets, int npackets)
+{
+	int		step, i;
+
+	step = npackets > CUT_SAMPLES ? npackets / CUT_SAMPLES : 1;
+	num_cut_samples = npackets / step;
+	cut_samples = realloc(cut_samples, num_cut_samples * sizeof(Packet));
+	for (i = 0; i < num_cut_samples; i++)
+		cut_samples[i] = packets[i * step];
+}
+
+
+
+// whether a rule in stripped form covers the whole of a node space
+int cover_space(Rule *rule, Range *space)
+{
+	int		dim;
+
+	for (dim = 0; dim < NFIELDS; dim++) {
+		if (!range_cover(rule->field[dim], space[dim]))
+			return 0;
+	}
+	return 1;
+}
+
+
+
+// multi-match: #rules of the child cut->val of v that go to its cover list
+int count_covers(Trie *v, Band *cut, Rule *rules_child, int nrules)
+{
+	Range	space[NFIELDS];
+	int		i, n = 0;
+
+	memcpy(space, dfs_bounds[v->depth], sizeof(space));
+	cut_range(&space[cut->dim], cut, dfs_points[v->depth]);
+	for (i = 0; i < nrules; i++)
+		n += cover_space(&rules_child[i], space);
+	return n;
+}
+
+
+
+void try_cut(Trie *v, Band *cut, CutStat *st)
 {
-	int		val, nrules, max_nrules = 0;
+	int		nrules, npkts, i, child_rules[BAND_SIZE], child_pkts[BAND_SIZE];
 	Rule	*rules_parent, *rules_child;
+	Packet	*pkts;
+	double	p;
+	PROF_START(PROF_TRY_CUT);
 
+	cuts_tried++;
 	rules_parent = dfs_rules_strip[v->depth][v->cut.val];
 	rules_child = malloc(v->nrules*sizeof(Rule));
-	*total_rules = 0;
+	memset(st, 0, sizeof(CutStat));
 
 	for (cut->val = 0; cut->val < BAND_SIZE; cut->val++) {
 		nrules = select_rules(rules_parent, rules_child, v->nrules, cut, v->depth);
-		if (nrules > max_nrules)
-			max_nrules = nrules;
-		*total_rules += nrules;
+		if (multi_match && nrules > 0)
+			nrules -= count_covers(v, cut, rules_child, nrules);
+		if (nrules > st->max_rules)
+			st->max_rules = nrules;
+		if (nrules > 0)
+			st->nchildren++;
+		st->total_rules += nrules;
+		child_rules[cut->val] = nrules;
+	}
+
+	for (i = 0; i < BAND_SIZE; i++) {
+		if (child_rules[i] == 0)
+			continue;
+		p = (double) child_rules[i] / st->total_rules;
+		st->entropy -= p * log2(p);
+	}
+
+	if (num_cut_samples > 0) {
+		pkts = dfs_pkts_strip[v->depth][v->cut.val];
+		npkts = dfs_npkts[v->depth][v->cut.val];
+		memset(child_pkts, 0, sizeof(child_pkts));
+		for (i = 0; i < npkts; i++)
+			child_pkts[cut_value(pkts[i].field[cut->dim], cut, dfs_points[v->depth])]++;
+		st->npkts = npkts;
+		for (i = 0; i < BAND_SIZE; i++)
+			st->pkt_rules += (long) child_pkts[i] * child_rules[i];
 	}
 	
 	free(rules_child);
-	return max_nrules;
+	PROF_STOP(PROF_TRY_CUT);
 }
 
 
 
-void choose_cut(Trie *v)
+// lowest scoring cut found so far by a cut strategy
+typedef struct {
+	Band		cut;
+	uint32_t	points[RANGE_POINTS];
+	double		score;
+	int			max_rules;
+} BestCut;
+
+// candidate cuts of a node, each scored with score_cut()
+typedef void (*CutStrategy)(Trie *v, BestCut *best);
+
+
+
+// score the cut dfs_cuts[v->depth] of v, a range cut on dfs_points[v->depth], and keep it in
+// best if it scores lower and its largest child has fewer than limit rules
+void score_cut(Trie *v, BestCut *best, int limit)
 {
-	Band	*cut;
-	int		dim, bid, nrules, max_rules, total_rules, max_total;
-	int		best_dim, best_bid;
+	Band	*cut = &dfs_cuts[v->depth];
+	CutStat	st;
+	double	score;
+
+	try_cut(v, cut, &st);
+	score = cut_score(v, &st);
+	if (score < best->score && st.max_rules < limit) {
+		best->cut = *cut;
+		best->score = score;
+		best->max_rules = st.max_rules;
+		if (cut->bid == RANGE_BID)
+			memcpy(best->points, dfs_points[v->depth], POINTS_BYTES);
+	}
+}
+
 
-	max_rules = v->nrules + 1;
-	max_total = v->nrules * BAND_SIZE + 1;
-	cut = &dfs_cuts[v->depth];
+
+// every band not cut yet, and the ports at the ends of their ranges
+void band_cuts(Trie *v, BestCut *best)
+{
+	Band	*cut = &dfs_cuts[v->depth];
+	int		dim, bid;
 
 	for (dim = 0; dim < NFIELDS; dim++) {
 		cut->dim = dim;
-		if (v->nrules <= REDUN_NRULES)
-			calc_rule_redun(v, cut);
+		calc_rule_redun(v, cut);
 		for (bid = 0; bid < dfs_uncuts[v->depth][dim]; bid++) {
 			cut->bid = bid;
-			nrules = try_cut(v, cut, &total_rules);
-			if (nrules > max_rules)
-				continue;
-			if (nrules < max_rules || total_rules < max_total) {
-				best_dim = dim;
-				best_bid = bid;
-				max_rules = nrules;
-				max_total = total_rules;
-			}
+			score_cut(v, best, INT_MAX);
+		}
+		if ((dim == 2 || dim == 3) && range_points(v, dim, dfs_points[v->depth]) > 0) {
+			cut->bid = RANGE_BID;
+			score_cut(v, best, INT_MAX);
+		}
+	}
+}
+
+
+
+// HiCuts: the node space of a field in MAX_CHILDREN intervals of equal size; the field is the
+// one the objective scores lowest instead of the HiCuts distinct range count
+void equal_cuts(Trie *v, BestCut *best)
+{
+	Band		*cut = &dfs_cuts[v->depth];
+	uint32_t	*points = dfs_points[v->depth];
+	uint64_t	span;
+	Range		b;
+	int			dim, n, i;
+
+	cut->bid = RANGE_BID;
+	for (dim = 0; dim < NFIELDS; dim++) {
+		b = dfs_bounds[v->depth][dim];
+		span = (uint64_t) b.hi - b.lo + 1;
+		if (span < 2)
+			continue;
+		n = span < MAX_CHILDREN ? span : MAX_CHILDREN;
+		for (i = 0; i < RANGE_POINTS; i++)
+			points[i] = i < n - 1 ? b.lo + (i + 1) * span / n : UINT32_MAX;
+		cut->dim = dim;
+		calc_rule_redun(v, cut);
+		score_cut(v, best, v->nrules);
+	}
+}
+
+
+
+// HyperSplit: two children split at the median of the distinct rule ends of a field
+void split_cuts(Trie *v, BestCut *best)
+{
+	Band		*cut = &dfs_cuts[v->depth];
+	uint32_t	*points = dfs_points[v->depth], *ends;
+	int			dim, m, i;
+
+	cut->bid = RANGE_BID;
+	for (dim = 0; dim < NFIELDS; dim++) {
+		ends = range_ends(v, dim, &m);
+		if (m > 0) {
+			points[0] = ends[m/2];
+			for (i = 1; i < RANGE_POINTS; i++)
+				points[i] = UINT32_MAX;
+			cut->dim = dim;
+			calc_rule_redun(v, cut);
+			score_cut(v, best, v->nrules);
+		}
+		free(ends);
+	}
+}
+
+
+
+// the cut strategies; the range cut ones stop at a node none of their cuts splits
+struct {
+	char		*name;
+	CutStrategy	cuts;
+	int			depth;		// depth limit of the trie
+} cut_strategies[] = {
+	{"band",		band_cuts,		BAND_DEPTH},
+	{"hicuts",		equal_cuts,		BAND_DEPTH},
+	{"hypersplit",	split_cuts,		MAX_DEPTH},
+	{NULL,			NULL,			0}
+};
+int		cut_strategy;
+
+
+
+int set_cut_strategy(char *name)
+{
+	int		i;
+
+	for (i = 0; cut_strategies[i].name != NULL; i++) {
+		if (strcmp(cut_strategies[i].name, name) == 0) {
+			cut_strategy = i;
+			return 1;
 		}
 	}
-	cut->dim = best_dim;
-	cut->bid = best_bid;
+	return 0;
+}
+
+
+
+// name of strategy i, NULL past the last
+char* cut_strategy_name(int i)
+{
+	return cut_strategies[i].name;
+}
+
+
+
+// choose the cut of v with the lowest score among the candidates of the cut strategy, return
+// the #rules of its largest child, or -1 when it has no cut
+int choose_cut(Trie *v)
+{
+	BestCut	best = {.score = HUGE_VAL};
+	PROF_START(PROF_CHOOSE_CUT);
+
+	cut_strategies[cut_strategy].cuts(v, &best);
+	if (best.score == HUGE_VAL) {
+		PROF_STOP(PROF_CHOOSE_CUT);
+		return -1;
+	}
+	dfs_cuts[v->depth] = best.cut;
+	if (best.cut.bid == RANGE_BID)
+		memcpy(dfs_points[v->depth], best.points, POINTS_BYTES);
+	cut_score_sum[v->depth] += best.score;
+	cut_nodes[v->depth]++;
+	PROF_STOP(PROF_CHOOSE_CUT);
+	return best.max_rules;
+}
+
+
+
+// packets of the parent falling in the cut space, stripped by the cut
+void select_packets(Trie *v, Band *cut)
+{
+	Packet	*pkts_parent, *pkts_child;
+	int		npkts_parent, npkts_child = 0, i;
+
+	pkts_parent = dfs_pkts_strip[v->depth][v->cut.val];
+	npkts_parent = dfs_npkts[v->depth][v->cut.val];
+	pkts_child = realloc(dfs_pkts_strip[v->depth+1][cut->val], (npkts_parent+1)*sizeof(Packet));
+
+	for (i = 0; i < npkts_parent; i++) {
+		if (cut_value(pkts_parent[i].field[cut->dim], cut, dfs_points[v->depth]) != cut->val)
+			continue;
+		pkts_child[npkts_child] = pkts_parent[i];
+		if (cut->bid != RANGE_BID)
+			pkts_child[npkts_child].field[cut->dim] = band_strip(pkts_parent[i].field[cut->dim], cut->bid);
+		npkts_child++;
+	}
+	dfs_pkts_strip[v->depth+1][cut->val] = pkts_child;
+	dfs_npkts[v->depth+1][cut->val] = npkts_child;
 }
 
 
+
 /******************************************************************************
  *
  * Section for node redundancy handling
@@ -190,19 +735,19 @@ enum {NOTFOUND, FOUND, INVALID};
 
 
 
-// return the child id with identical rule set, return -1 if not found
-int find_node(Rule **ruleset, int nrules, Trie *parent, int start)
+// return the child id with identical rule set (and default rule), return -1 if not found
+int find_node(Trie *u, Trie *parent, int start)
 {
-	Rule	**rules_child;
-	int		nrules_child, i;
+	Trie	*w;
+	int		i;
 	
 	// reverse order checking as neighbor nodes are more likely to be redundant
 	for (i = start; i >= 0; i--) {
-		nrules_child = parent->children[i].nrules;
-		if (nrules_child != nrules)
+		w = &parent->children[i];
+		if (w->nrules != u->nrules || w->full_cover != u->full_cover || w->ncovers != u->ncovers)
 			continue;
-		rules_child = parent->children[i].rules;
-		if (memcmp(ruleset, rules_child, nrules*sizeof(Rule *)) == 0)
+		if (memcmp(u->rules, w->rules, u->nrules*sizeof(Rule *)) == 0 &&
+				memcmp(u->covers, w->covers, u->ncovers*sizeof(Rule *)) == 0)
 			break;
 	}
 	return i;
@@ -216,13 +761,13 @@ int check_node_redun(Trie *u)
 	Rule	*rules0, *rules1;
 	Range	*r0, *r1;
 
-	child_id = find_node(u->rules, u->nrules, u->parent, u->parent->nchildren-1);
+	child_id = find_node(u, u->parent, u->parent->nchildren-1);
 	if (child_id == -1)
 		return -1;
-	if (u->nrules <= LEAF_RULES || u->cut.dim < 2 || u->cut.dim > 3)
+	if (u->nrules <= LEAF_RULES || (u->cut.bid != RANGE_BID && (u->cut.dim < 2 || u->cut.dim > 3)))
 		return child_id;
 
-	// need more inspection for port cuts even rules are identical
+	// need more inspection for port and range cuts even rules are identical
 	while (child_id >= 0) {
 		rules0 = dfs_rules_strip[u->depth][u->cut.val];
 		rules1 = dfs_rules_strip[u->depth][u->parent->children[child_id].cut.val];
@@ -234,7 +779,7 @@ int check_node_redun(Trie *u)
 		}
 		if (i == u->nrules)
 			return child_id;
-		child_id = find_node(u->rules, u->nrules, u->parent, child_id-1);
+		child_id = find_node(u, u->parent, child_id-1);
 	}
 	return -1;
 }
@@ -246,19 +791,62 @@ int check_node_redun(Trie *u)
  *
  *****************************************************************************/
 
+// whether the rule covers the whole space of the child of parent being made
 int full_cover_rule(Rule *rule, Trie *parent)
 {
-	int		dim, nbits, hi;
+	return cover_space(rule, dfs_bounds[parent->depth+1]);
+}
 
-	for (dim = 0; dim < NFIELDS; dim++) {
-		if (rule->field[dim].lo != 0)
-			return 0;
-		nbits = dfs_uncuts[parent->depth][dim]*BAND_BITS;
-		hi = nbits == 32 ? 0xffffffff : (1 << nbits) - 1;
-		if (rule->field[dim].hi != hi)
-			return 0;
+
+
+// multi-match: move the rules covering the space of u out of its rules into its cover list,
+// keeping its stripped rules in step
+void split_covers(Trie *u, Rule *rules_strip)
+{
+	int		i, n = 0;
+
+	u->ncovers = 0;
+	u->covers = NULL;
+	for (i = 0; i < u->nrules; i++) {
+		if (cover_space(&rules_strip[i], dfs_bounds[u->depth])) {
+			if (u->covers == NULL)
+				u->covers = malloc(u->nrules * sizeof(Rule *));
+			u->covers[u->ncovers++] = u->rules[i];
+		} else {
+			u->rules[n] = u->rules[i];
+			rules_strip[n] = rules_strip[i];
+			n++;
+		}
 	}
-	return 1;
+	if (u->covers != NULL)
+		u->covers = realloc(u->covers, u->ncovers * sizeof(Rule *));
+	u->nrules = n;
+}
+
+
+
+int cmp_rule_id(const void *a, const void *b)
+{
+	return (*(Rule **) a)->id - (*(Rule **) b)->id;
+}
+
+
+
+// the distinct rules of parent v that dropped a rule from its child u, by id
+void set_pruners(Trie *u, Trie *v)
+{
+	int		i, n = 0;
+
+	u->pruners = malloc(select_pruned * sizeof(Rule *));
+	for (i = 0; i < select_pruned; i++)
+		u->pruners[i] = v->rules[select_pruners[i]];
+	qsort(u->pruners, select_pruned, sizeof(Rule *), cmp_rule_id);
+	for (i = 0; i < select_pruned; i++) {
+		if (n == 0 || u->pruners[i] != u->pruners[n-1])
+			u->pruners[n++] = u->pruners[i];
+	}
+	u->pruners = realloc(u->pruners, n * sizeof(Rule *));
+	u->npruners = n;
 }
 
 
@@ -279,10 +867,15 @@ Trie* new_child(Trie *v, Band *cut)
 
 	u = &v->children[v->nchildren];
 	u->nrules = select_rules(rules_parent, rules_child, v->nrules, cut, v->depth);
+	rules_pruned += select_pruned;
 	if (u->nrules == 0)
 		return NULL;
+	if (num_cut_samples > 0)
+		select_packets(v, cut);
+	memcpy(dfs_bounds[v->depth+1], dfs_bounds[v->depth], sizeof(dfs_bounds[0]));
+	cut_range(&dfs_bounds[v->depth+1][cut->dim], cut, dfs_points[v->depth]);
 #if 1
-	if (full_cover_rule(&rules_child[u->nrules-1], v)) {
+	if (!multi_match && full_cover_rule(&rules_child[u->nrules-1], v)) {
 		u->full_cover = v->rules[rule_map_c2p[u->nrules-1]];
 		u->nrules--;
 	} else
@@ -295,19 +888,38 @@ Trie* new_child(Trie *v, Band *cut)
 	u->parent = v;
 	u->cut = *cut;
 	u->depth = v->depth + 1;
+	u->ncovers = 0;
+	u->covers = NULL;
+	if (multi_match)
+		split_covers(u, rules_child);
+	u->npruners = 0;
+	u->pruners = NULL;
+	if (keep_pruners && select_pruned > 0)
+		set_pruners(u, v);
 	u->id = total_nodes;
 	u->child_id = v->nchildren;
 	u->type = u->nrules > LEAF_RULES ? NONLEAF : LEAF;
 	u->nchildren = 0;
+	u->points = NULL;
+	u->present = 0;
+	u->cindex = 0;
+	u->children = NULL;
+	u->ids = NULL;
 	// check node redundancy
 #if 1
+	PROF_START(PROF_CHECK_NODE_REDUN);
 	redund = check_node_redun(u);
+	PROF_STOP(PROF_CHECK_NODE_REDUN);
 	if (redund >= 0) {
+		nodes_dedup++;
 		free(u->rules);
+		free(u->covers);
+		free(u->pruners);
+		set_child(v, cut->val, redund);
 		return NULL;
 	}
 #endif
-	u->children = malloc(MAX_CHILDREN * sizeof(Trie));
+	set_child(v, cut->val, v->nchildren);
 	v->nchildren++;
 
 	if (total_nodes >= trie_nodes_size) {
@@ -346,26 +958,41 @@ int	calc_cut_efficiency(int depth, int parent_nrules, int nrules)
 
 void create_children(Trie *v)
 {
-	int		dim, val, max_child_nrules = 0;
+	int		dim, val, max_rules, max_child_nrules = 0;
 	Band	*cut;
 	Trie	*u;
 
-	if (v->depth >= MAX_DEPTH-1) {
+	if (v->depth >= cut_strategies[cut_strategy].depth-1) {
 		//dump_path(v, 2);
 		return;
 	}
+	if (__atomic_load_n(&build_cancel, __ATOMIC_RELAXED))
+		return;
 
 	if (v->depth > 0)	{
 		for (dim = 0; dim < NFIELDS; dim++)
 			dfs_uncuts[v->depth][dim] = dfs_uncuts[v->depth-1][dim];
 	}
 
-	choose_cut(v);
+	// with all matching rules kept, overlapping rules may never separate
+	max_rules = choose_cut(v);
+	if (max_rules < 0 || (max_rules >= v->nrules && multi_match)) {
+		v->type = LEAF;
+		leaf_nodes++;
+		depth_leaf_nodes[v->depth]++;
+		return;
+	}
 	cut = &dfs_cuts[v->depth];
-	dfs_uncuts[v->depth][cut->dim]--;
-	if (v->nrules <= REDUN_NRULES)
-		calc_rule_redun(v, cut);
+	v->split = *cut;
+	if (cut->bid == RANGE_BID) {
+		v->points = malloc(POINTS_BYTES);
+		memcpy(v->points, dfs_points[v->depth], POINTS_BYTES);
+	} else {
+		dfs_uncuts[v->depth][cut->dim]--;
+	}
+	calc_rule_redun(v, cut);
 
+	v->children = malloc(MAX_CHILDREN * sizeof(Trie));
 	for (val = 0; val < BAND_SIZE; val++) {
 		cut->val = val;
 		u = new_child(v, cut);
@@ -383,39 +1010,437 @@ void create_children(Trie *v)
 	calc_cut_efficiency(v->depth, v->nrules, max_child_nrules);
 	depth_max_node[v->depth+1] = max_child_nrules;
 	v->children = realloc(v->children, v->nchildren*sizeof(Trie));
-	dfs_uncuts[v->depth][cut->dim]++;
+	relink_children(v);
+	if (cut->bid != RANGE_BID)
+		dfs_uncuts[v->depth][cut->dim]++;
 }
 
 
 
-Trie* init_trie(Rule *rules, int nrules)
+// index in v->children of the child of cut value val, -1 when the value has no rules
+inline
+int child_index(Trie *v, int val)
 {
-	int		depth, i;
-	Trie 	*node = calloc(1, sizeof(Trie));
+	return v->present >> val & 1 ? (int) (v->cindex >> 4 * val & 0xF) : -1;
+}
 
-	// init dfs related data structure
-	dfs_uncuts[0][0] = dfs_uncuts[0][1] = 8;
-	dfs_uncuts[0][2] = dfs_uncuts[0][3] = 4;
-	dfs_uncuts[0][4] = 2;
-	dfs_rules_strip[0][0] = malloc(nrules*sizeof(Rule));
-	rule_map_c2p = malloc(nrules * sizeof(int));
-	rule_map_p2c = malloc(nrules * sizeof(int));
 
-	// create root node
-	node->type = NONLEAF;
-	node->id = total_nodes++;
-	node->child_id = 0;
-	node->depth = 0;
-	node->nrules = nrules;
-	node->rules = malloc(nrules*sizeof(Rule *));
-	for (i = 0; i < nrules; i++) {
-		node->rules[i] = &rules[i];
-		dfs_rules_strip[0][0][i] = rules[i];
+
+inline
+void set_child(Trie *v, int val, int index)
+{
+	v->present |= 1 << val;
+	v->cindex = (v->cindex & ~(0xFULL << 4 * val)) | (uint64_t) index << 4 * val;
+}
+
+
+
+// point the children of v, and their children, back to where the children array now is
+void relink_children(Trie *v)
+{
+	Trie	*u;
+	int		i, j;
+
+	for (i = 0; i < v->nchildren; i++) {
+		u = &v->children[i];
+		u->parent = v;
+		trie_nodes[u->id] = u;
+		for (j = 0; j < u->nchildren; j++)
+			u->children[j].parent = u;
+	}
+}
+
+
+
+// set up the dfs state of node v as the build left it: path[] from the root, the bands not
+// cut above it and its space
+void path_state(Trie *v, Trie **path)
+{
+	Trie	*u;
+	Band	*cut;
+	int		depth, dim;
+
+	for (u = v; u != NULL; u = u->parent)
+		path[u->depth] = u;
+
+	if (v->depth == 0)
+		return;
+	for (dim = 0; dim < NFIELDS; dim++)
+		dfs_uncuts[v->depth-1][dim] = field_bands[dim];
+	for (depth = 0; depth < v->depth; depth++) {
+		if (path[depth]->split.bid != RANGE_BID)
+			dfs_uncuts[v->depth-1][path[depth]->split.dim]--;
+	}
+	memcpy(dfs_bounds[v->depth], dfs_bounds[0], sizeof(dfs_bounds[0]));
+	for (depth = 1; depth <= v->depth; depth++) {
+		cut = &path[depth]->cut;
+		cut_range(&dfs_bounds[v->depth][cut->dim], cut, path[depth-1]->points);
+	}
+}
+
+
+
+// rule in the stripped form of the node at depth of path, return 0 if outside its space
+int strip_path(Trie **path, int depth, Rule *rule, Rule *out)
+{
+	Band	*cut;
+	int		d;
+
+	*out = *rule;
+	for (d = 1; d <= depth; d++) {
+		cut = &path[d]->cut;
+		if (!cut_range(&out->field[cut->dim], cut, path[d-1]->points))
+			return 0;
+	}
+	return 1;
+}
+
+
+
+// rebuild a leaf into a subtree with a different leaf size. The dfs state of the leaf is
+// recovered by replaying the cuts on its path, the subtree is built aside and published by
+// setting nchildren last, so that a concurrent lookup sees either the leaf or the subtree.
+// Not to be run together with build_trie() or another rebuild. Return #nodes added
+int rebuild_node(Trie *v, int leaf_rules)
+{
+	Trie	w, *path[MAX_DEPTH], *old;
+	Rule	*rules;
+	int		i, nshare = 0, nodes = total_nodes, saved_leaf_rules = LEAF_RULES;
+
+	if (v->parent == NULL || v->nchildren > 0 || v->nrules <= leaf_rules ||
+			v->depth >= cut_strategies[cut_strategy].depth-1)
+		return 0;
+
+	// a leaf shared by siblings of a port or range cut may differ in stripped ranges among them
+	for (i = 0; i < BAND_SIZE; i++)
+		nshare += child_index(v->parent, i) >= 0 && &v->parent->children[child_index(v->parent, i)] == v;
+	if (nshare > 1 && (v->parent->split.bid == RANGE_BID ||
+				(v->parent->split.dim >= 2 && v->parent->split.dim <= 3)))
+		return 0;
+	unpack_leaf(v);
+	path_state(v, path);
+
+	rules = realloc(dfs_rules_strip[v->depth][v->cut.val], v->nrules*sizeof(Rule));
+	for (i = 0; i < v->nrules; i++)
+		strip_path(path, v->depth, v->rules[i], &rules[i]);
+	dfs_rules_strip[v->depth][v->cut.val] = rules;
+	dfs_npkts[v->depth][v->cut.val] = 0;
+
+	w = *v;
+	w.type = NONLEAF;
+	w.nchildren = 0;
+	w.points = NULL;
+	w.children = NULL;
+	w.present = 0;
+	w.cindex = 0;
+	LEAF_RULES = leaf_rules;
+	create_children(&w);
+	LEAF_RULES = saved_leaf_rules;
+
+	// publish the subtree
+	v->split = w.split;
+	v->points = w.points;
+	v->present = w.present;
+	v->cindex = w.cindex;
+	old = v->children;
+	v->children = w.children;
+	v->type = NONLEAF;
+	__atomic_store_n(&v->nchildren, w.nchildren, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&trie_generation, 1, __ATOMIC_RELEASE);
+	relink_children(v);
+	free(old);
+
+	leaf_nodes--;
+	depth_leaf_nodes[v->depth]--;
+	return total_nodes - nodes;
+}
+
+
+
+/******************************************************************************
+ *
+ * Section for subtree replacement by rule updates
+ *
+ *****************************************************************************/
+
+// whether the child at index k of v is shared by more than one cut value
+int child_shared(Trie *v, int k)
+{
+	int		val, n = 0;
+
+	for (val = 0; val < BAND_SIZE; val++)
+		n += child_index(v, val) == k;
+	return n > 1;
+}
+
+
+
+// whether a rule dropped from u as covered may come back when rule is deleted
+int pruned_by(Trie *u, Rule *rule)
+{
+	return bsearch(&rule, u->pruners, u->npruners, sizeof(Rule *), cmp_rule_id) != NULL;
+}
+
+
+
+// the stop nodes (or the nodes above them when above) of rule in the subtree of v, see
+// update_roots()
+void find_roots(Trie *v, Rule *rule, Range *space, int above, Trie ***out, int *n, int *size)
+{
+	Rule	r;
+	Range	s[NFIELDS];
+	Band	cut = v->split;
+	int		val, k, stop = v->nchildren == 0 || cover_space(rule, space);
+
+	for (val = 0; val < BAND_SIZE && !stop; val++) {
+		cut.val = val;
+		r = *rule;
+		if (cut_range(&r.field[cut.dim], &cut, v->points))
+			stop = (k = child_index(v, val)) < 0 || child_shared(v, k);
+	}
+	if (stop == !above) {
+		if (*n == *size) {
+			*size = *size > 0 ? *size * 2 : 64;
+			*out = realloc(*out, *size * sizeof(Trie *));
+		}
+		(*out)[(*n)++] = v;
+	}
+	if (stop)
+		return;
+	for (val = 0; val < BAND_SIZE; val++) {
+		cut.val = val;
+		r = *rule;
+		if (!cut_range(&r.field[cut.dim], &cut, v->points))
+			continue;
+		memcpy(s, space, sizeof(s));
+		cut_range(&s[cut.dim], &cut, v->points);
+		find_roots(&v->children[child_index(v, val)], &r, s, above, out, n, size);
+	}
+}
+
+
+
+// add to roots[] (of *size, grown as needed) the nodes to rebuild when rule is added or deleted:
+// the leaves it overlaps, or the node where it covers the space, overlaps a cut value without
+// a child or a child shared by values
+void update_roots(Trie *root, Rule *rule, Trie ***roots, int *n, int *size)
+{
+	find_roots(root, rule, dfs_bounds[0], 0, roots, n, size);
+}
+
+
+
+// add to nodes[] the nodes above the roots of update_roots(), parents before children: those
+// whose rule lists the rule enters or leaves in place
+void update_path(Trie *root, Rule *rule, Trie ***nodes, int *n, int *size)
+{
+	find_roots(root, rule, dfs_bounds[0], 1, nodes, n, size);
+}
+
+
+
+// the nodes of the subtree of v
+int subtree_nodes(Trie *v)
+{
+	int		i, n = 1;
+
+	for (i = 0; i < v->nchildren; i++)
+		n += subtree_nodes(&v->children[i]);
+	return n;
+}
+
+
+
+// of the rules (in priority order, NULL for none), those overlapping the space of v into out up
+// to the first one covering it, which goes to *cover; with their stripped forms into strip
+// when not NULL. Sets up the dfs state of v as for rebuild_node(). Return #rules in out
+int space_rules(Trie *v, Rule **rules, int nrules, Rule **out, Rule **cover, Rule *strip)
+{
+	Trie	*path[MAX_DEPTH];
+	Rule	r, *s = strip != NULL ? strip : &r;
+	int		i, n = 0;
+
+	path_state(v, path);
+	*cover = NULL;
+	for (i = 0; i < nrules; i++) {
+		if (rules[i] == NULL || !strip_path(path, v->depth, rules[i], s))
+			continue;
+		if (cover_space(s, dfs_bounds[v->depth])) {
+			*cover = rules[i];
+			break;
+		}
+		out[n++] = rules[i];
+		if (strip != NULL)
+			s = &strip[n];
+	}
+	return n;
+}
+
+
+
+// refill the list of node v, above the roots of an update, from the rules that may overlap it
+// (see space_rules()). None is pruned; the pruners of v stay for the rules its children lack
+void refill_rules(Trie *v, Rule **rules, int nrules)
+{
+	Rule	*cover;
+
+	v->rules = realloc(v->rules, nrules * sizeof(Rule *));
+	v->nrules = space_rules(v, rules, nrules, v->rules, &cover, NULL);
+	v->full_cover = cover;
+}
+
+
+
+// build into w a replacement of node v from the candidate rules (see space_rules()), those that
+// may overlap v rather than the rule set: w keeps the pruners of v for the rules they dropped.
+// Return #nodes built below w
+int rebuild_subtree(Trie *v, Rule **rules, int nrules, int leaf_rules, Trie *w)
+{
+	Rule	*strip;
+	int		n, nodes = total_nodes, saved_leaf_rules = LEAF_RULES;
+
+	strip = realloc(dfs_rules_strip[v->depth][v->cut.val], nrules * sizeof(Rule));
+	*w = *v;
+	w->rules = malloc(nrules * sizeof(Rule *));
+	w->ncovers = 0;
+	w->covers = NULL;
+	w->pruners = NULL;
+	if (v->npruners > 0)
+		w->pruners = memcpy(malloc(v->npruners * sizeof(Rule *)), v->pruners,
+				v->npruners * sizeof(Rule *));
+	n = space_rules(v, rules, nrules, w->rules, &w->full_cover, strip);
+	dfs_rules_strip[v->depth][v->cut.val] = strip;
+	dfs_npkts[v->depth][v->cut.val] = 0;
+
+	w->nrules = n;
+	w->type = n > leaf_rules ? NONLEAF : LEAF;
+	w->nchildren = 0;
+	w->points = NULL;
+	w->present = 0;
+	w->cindex = 0;
+	w->children = NULL;
+	w->ids = NULL;
+	if (n > leaf_rules) {
+		LEAF_RULES = leaf_rules;
+		create_children(w);
+		LEAF_RULES = saved_leaf_rules;
+	} else {
+		leaf_nodes++;
+		depth_leaf_nodes[w->depth]++;
+	}
+	return total_nodes - nodes;
+}
+
+
+
+// publish w, built by rebuild_subtree(), in place of v: the lookups switch to a copy of the
+// children array of the parent holding w, or to a new root in *root. Return the array (or the
+// root) left behind, where the entry of v is still to be freed with free_node(); the lookups
+// may be on both until they leave the trie
+Trie* replace_node(Trie *v, Trie *w, Trie **root)
+{
+	Trie	*p = v->parent, *old, *children;
+
+	if (v->type == LEAF) {
+		leaf_nodes--;
+		depth_leaf_nodes[v->depth]--;
+	}
+	if (p == NULL) {
+		old = *root;
+		children = malloc(sizeof(Trie));
+		*children = *w;
+		trie_nodes[w->id] = root_node = children;
+		__atomic_store_n(root, children, __ATOMIC_RELEASE);
+		relink_children(children);
+	} else {
+		old = p->children;
+		children = malloc(p->nchildren * sizeof(Trie));
+		memcpy(children, old, p->nchildren * sizeof(Trie));
+		children[v - old] = *w;
+		__atomic_store_n(&p->children, children, __ATOMIC_RELEASE);
+		relink_children(p);
+	}
+	__atomic_add_fetch(&trie_generation, 1, __ATOMIC_RELEASE);
+	return old;
+}
+
+
+
+// take the nodes below v, replaced and not yet freed, out of trie_nodes; the last node fills
+// each hole
+void drop_subtree(Trie *v)
+{
+	Trie	*u, *last;
+	int		i;
+
+	for (i = 0; i < v->nchildren; i++) {
+		u = &v->children[i];
+		drop_subtree(u);
+		depth_nodes[u->depth]--;
+		if (u->type == LEAF) {
+			leaf_nodes--;
+			depth_leaf_nodes[u->depth]--;
+		}
+		last = trie_nodes[--total_nodes];
+		trie_nodes[u->id] = last;
+		last->id = u->id;
+	}
+}
+
+
+
+Trie* init_trie(Rule *rules, int nrules)
+{
+	int		depth, i;
+	Trie 	*node = calloc(1, sizeof(Trie));
+
+	// init dfs related data structure
+	dfs_uncuts[0][0] = dfs_uncuts[0][1] = 8;
+	dfs_uncuts[0][2] = dfs_uncuts[0][3] = 4;
+	dfs_uncuts[0][4] = 2;
+	for (i = 0; i < NFIELDS; i++) {
+		dfs_bounds[0][i].lo = 0;
+		dfs_bounds[0][i].hi = dfs_uncuts[0][i] == 8 ? UINT32_MAX : (1U << dfs_uncuts[0][i]*BAND_BITS) - 1;
+	}
+	dfs_rules_strip[0][0] = malloc(nrules*sizeof(Rule));
+	rule_map_c2p = malloc(nrules * sizeof(int));
+	rule_map_p2c = malloc(nrules * sizeof(int));
+	select_pruners = malloc(nrules * sizeof(int));
+	for (depth = 0; depth < MAX_DEPTH; depth++)
+		dfs_redun_first[depth] = malloc((nrules + 1) * sizeof(int));
+	for (hull_table_size = 16; hull_table_size < 2 * nrules; hull_table_size *= 2)
+		;
+	hull_table = malloc(hull_table_size * sizeof(int));
+	hull_next = malloc(nrules * sizeof(int));
+	for (i = 0; i < 2; i++) {
+		hull_bits[i] = malloc(nrules * sizeof(int));
+		hull_val[i] = malloc(nrules * sizeof(uint32_t));
+	}
+	if (num_cut_samples > 0) {
+		dfs_pkts_strip[0][0] = malloc(num_cut_samples * sizeof(Packet));
+		memcpy(dfs_pkts_strip[0][0], cut_samples, num_cut_samples * sizeof(Packet));
+		dfs_npkts[0][0] = num_cut_samples;
+	}
+
+	// create root node
+	node->type = NONLEAF;
+	node->id = total_nodes++;
+	node->child_id = 0;
+	node->depth = 0;
+	node->nrules = nrules;
+	node->rules = malloc(nrules*sizeof(Rule *));
+	for (i = 0; i < nrules; i++) {
+		node->rules[i] = &rules[i];
+		dfs_rules_strip[0][0][i] = rules[i];
 	}
 	node->full_cover = NULL;
+	if (multi_match)
+		split_covers(node, dfs_rules_strip[0][0]);
 
+	node->present = 0;
+	node->cindex = 0;
 	node->nchildren = 0;
-	node->children = malloc(MAX_CHILDREN * sizeof(Trie));
+	node->children = NULL;
 
 	trie_nodes = (Trie **) malloc(NODES_CHUNK*sizeof(Trie *));
 	trie_nodes[0] = node;
@@ -488,7 +1513,8 @@ void dump_stats()
 				i, depth_nodes[i], depth_leaf_nodes[i], depth_max_node[i]);
 		for (j = 0; j < EFFI_LEVEL; j++)
 			printf("%d, ", cut_efficiency[i][j]);
-		printf("}\n");
+		printf("} %s:%.3f\n", cut_objective, 
+				cut_nodes[i] > 0 ? cut_score_sum[i] / cut_nodes[i] : 0);
 	}
 
 	printf("total nodes:%d, leaf nodes:%d, max depth:%d\n", total_nodes, leaf_nodes, max_depth+1);
@@ -496,18 +1522,830 @@ void dump_stats()
 
 
 
+inline long node_bytes(Trie *v)
+{
+	return sizeof(Trie) + v->nrules * sizeof(Rule *) + (v->points != NULL ? POINTS_BYTES : 0);
+}
+
+
+
+// build metrics as JSON; the timers are inclusive (choose_cut contains try_cut, which contains
+// select_rules) and only counted with -DPROFILE
+void dump_json(FILE *fp)
+{
+	long	leaf_refs = 0, rule_refs = 0, type_bytes[2] = {0, 0};
+	int		nodes[2] = {0, 0}, i, j, type;
+	Trie	*v;
+
+	for (i = 0; i < total_nodes; i++) {
+		v = trie_nodes[i];
+		type = v->nchildren > 0 ? NONLEAF : LEAF;
+		nodes[type]++;
+		type_bytes[type] += node_bytes(v);
+		rule_refs += v->nrules;
+		if (type == LEAF)
+			leaf_refs += v->nrules;
+	}
+
+	fprintf(fp, "{\n");
+	fprintf(fp, "  \"rules\": %d,\n  \"leaf_rules\": %d,\n  \"strategy\": \"%s\",\n  \"objective\": \"%s\",\n",
+			total_rules, LEAF_RULES, cut_strategies[cut_strategy].name, cut_objective);
+	fprintf(fp, "  \"build_ms\": %.3f,\n  \"peak_rss_kb\": %ld,\n", build_seconds * 1e3, peak_rss_kb());
+	fprintf(fp, "  \"nodes\": %d,\n  \"max_depth\": %d,\n", total_nodes, max_depth + 1);
+	fprintf(fp, "  \"cuts_tried\": %ld,\n  \"rules_pruned\": %ld,\n  \"nodes_dedup\": %ld,\n",
+			cuts_tried, rules_pruned, nodes_dedup);
+	fprintf(fp, "  \"replication\": {\"leaf\": %.3f, \"all\": %.3f},\n",
+			(double) leaf_refs / total_rules, (double) rule_refs / total_rules);
+	for (type = 0; type < 2; type++) {
+		fprintf(fp, "  \"%s\": {\"nodes\": %d, \"bytes\": %ld},\n",
+				type == LEAF ? "leaf" : "nonleaf", nodes[type], type_bytes[type]);
+	}
+	fprintf(fp, "  \"depths\": [");
+	for (i = 1; i < MAX_DEPTH && depth_nodes[i] > 0; i++) {
+		fprintf(fp, "%s{\"nodes\": %d, \"leaves\": %d, \"max_node\": %d, \"cut_efficiency\": [",
+				i > 1 ? ", " : "", depth_nodes[i], depth_leaf_nodes[i], depth_max_node[i]);
+		for (j = 0; j < EFFI_LEVEL; j++)
+			fprintf(fp, "%s%d", j > 0 ? ", " : "", cut_efficiency[i][j]);
+		fprintf(fp, "]}");
+	}
+	fprintf(fp, "],\n");
+	dump_lookup_stats(fp, 1);
+	fprintf(fp, "  \"timers\": {");
+	for (i = 0; i < NPROF; i++) {
+		fprintf(fp, "%s\"%s\": {\"ms\": %.3f, \"calls\": %lu}", i > 0 ? ", " : "",
+				prof_names[i], prof_ns[i] / 1e6, prof_calls[i]);
+	}
+	fprintf(fp, "}\n}\n");
+}
+
+
+
+// one CSV row of the bench target: the build, the nodes per depth as in dump_stats(), the
+// bytes per rule and the lookup rate
+void dump_bench(FILE *fp, char *name, double mpps)
+{
+	long	bytes = 0;
+	int		leaves = 0, i;
+
+	for (i = 0; i < total_nodes; i++) {
+		bytes += node_bytes(trie_nodes[i]);
+		leaves += trie_nodes[i]->nchildren == 0;
+	}
+	fprintf(fp, "%s,%d,%d,%.3f,%d,%d,%d,", name, total_rules, LEAF_RULES, build_seconds * 1e3,
+			total_nodes, leaves, max_depth + 1);
+	for (i = 1; i < MAX_DEPTH && depth_nodes[i] > 0; i++)
+		fprintf(fp, "%s%d", i > 1 ? "/" : "", depth_nodes[i]);
+	fprintf(fp, ",%.1f,%.2f\n", (double) bytes / total_rules, mpps);
+}
+
+
+
+// decision tree quality of the built trie for comparing the cut strategies: the rules and
+// replication per level, the leaf sizes in power of 2 bins, the worst case path and memory
+void dump_quality(FILE *fp)
+{
+	long	level_rules[MAX_DEPTH] = {0}, bytes = 0;
+	int		leaf_bins[LEAF_BINS] = {0}, worst_rules = 0, worst_depth = 0, i, bin;
+	Trie	*v, *worst = NULL;
+
+	for (i = 0; i < total_nodes; i++) {
+		v = trie_nodes[i];
+		bytes += node_bytes(v);
+		level_rules[v->depth] += v->nrules;
+		if (v->nchildren > 0)
+			continue;
+		for (bin = 0; bin < LEAF_BINS-1 && v->nrules >= 1 << bin; bin++)
+			;
+		leaf_bins[bin]++;
+		// a lookup walks the path then compares the leaf rules
+		if (worst == NULL || v->depth + v->nrules > worst->depth + worst->nrules)
+			worst = v;
+		if (v->nrules > worst_rules)
+			worst_rules = v->nrules;
+		if (v->depth > worst_depth)
+			worst_depth = v->depth;
+	}
+
+	fprintf(fp, "%s: %d nodes, %.1f ms, %ld bytes (%.1f/rule)\n", cut_strategies[cut_strategy].name,
+			total_nodes, build_seconds * 1e3, bytes, (double) bytes / total_rules);
+	fprintf(fp, "  replication per level:");
+	for (i = 0; i < MAX_DEPTH && level_rules[i] > 0; i++)
+		fprintf(fp, " %.2f", (double) level_rules[i] / total_rules);
+	fprintf(fp, "\n  leaf rules 0, 1, 2-3, .. %d+:", 1 << (LEAF_BINS-2));
+	for (i = 0; i < LEAF_BINS; i++)
+		fprintf(fp, " %d", leaf_bins[i]);
+	fprintf(fp, "\n  worst path: %d nodes and %d rules; deepest leaf %d, largest leaf %d rules\n",
+			worst->depth + 1, worst->nrules, worst_depth + 1, worst_rules);
+}
+
+
+
+void dump_hist(FILE *fp, char *name, uint64_t *hist, int nbins, int json)
+{
+	double	sum = 0;
+	int		i, n;
+
+	for (n = nbins; n > 1 && hist[n-1] == 0; n--)
+		;
+	for (i = 0; i < nbins; i++)
+		sum += (double) i * hist[i];
+	if (json)
+		fprintf(fp, "    \"%s\": {\"mean\": %.3f, \"hist\": [", name,
+				lookup_stats.lookups > 0 ? sum / lookup_stats.lookups : 0);
+	else
+		fprintf(fp, "%s: mean %.3f, {", name, lookup_stats.lookups > 0 ? sum / lookup_stats.lookups : 0);
+	for (i = 0; i < n; i++)
+		fprintf(fp, "%s%lu", i > 0 ? ", " : "", hist[i]);
+	fprintf(fp, json ? "]}" : "}\n");
+}
+
+
+
+// histograms of the lookups so far, when compiled with -DLOOKUP_STATS; the cache lines count
+// every line spanned by a visited node, the rule list and the compared rules
+void dump_lookup_stats(FILE *fp, int json)
+{
+#ifdef LOOKUP_STATS
+	if (json) {
+		fprintf(fp, "  \"lookup\": {\n    \"lookups\": %lu,\n    \"cover\": %lu,\n",
+				lookup_stats.lookups, lookup_stats.cover);
+	} else {
+		fprintf(fp, "lookups:%lu, decided by full cover:%lu\n", lookup_stats.lookups, lookup_stats.cover);
+	}
+	dump_hist(fp, "depth", lookup_stats.depth, MAX_DEPTH, json);
+	fprintf(fp, json ? ",\n" : "");
+	dump_hist(fp, "rules_compared", lookup_stats.rules, LOOKUP_HIST, json);
+	fprintf(fp, json ? ",\n" : "");
+	dump_hist(fp, "cache_lines", lookup_stats.lines, LOOKUP_HIST, json);
+	fprintf(fp, json ? "\n  },\n" : "");
+#endif
+}
+
+
+
 // trie construction with a depth-first traverse (dfs)
 Trie* build_trie(Rule *rules, int nrules, int leaf_rules)
 {
 	Trie*	v;
 	int		i;
+	uint64_t	t0 = prof_now();
 
 	total_rules = nrules;
 	LEAF_RULES = leaf_rules;
+	band_rules = band_rules_new(rules, nrules);
 	root_node = init_trie(rules, nrules);
 	create_children(root_node);
+	build_seconds = (prof_now() - t0) / 1e9;
+	__atomic_add_fetch(&trie_generation, 1, __ATOMIC_RELEASE);
+
+	if (build_report)
+		dump_stats();
+	return root_node;
+}
+
+
+
+void free_node(Trie *v)
+{
+	int		i;
+
+	for (i = 0; i < v->nchildren; i++)
+		free_node(&v->children[i]);
+	free(v->children);
+	free(v->rules);
+	free(v->covers);
+	free(v->pruners);
+	free(v->points);
+}
+
+
+
+// free a trie as built_trie() made it, not relaid out
+void free_trie(Trie *root)
+{
+	free_node(root);
+	free(root);
+}
+
+
+
+// free the state kept by the last build_trie() for rebuild_node() and zero the statistics,
+// so that many tries can be built one after another
+void build_reset()
+{
+	int		depth, i;
+
+	free(dfs_rules_strip[0][0]);
+	dfs_rules_strip[0][0] = NULL;
+	if (num_cut_samples > 0) {
+		free(dfs_pkts_strip[0][0]);
+		dfs_pkts_strip[0][0] = NULL;
+	}
+	free(rule_map_c2p);
+	free(rule_map_p2c);
+	free(select_pruners);
+	for (depth = 0; depth < MAX_DEPTH; depth++)
+		free(dfs_redun_first[depth]);
+	free(hull_table);
+	free(hull_next);
+	for (i = 0; i < 2; i++) {
+		free(hull_bits[i]);
+		free(hull_val[i]);
+	}
+	free(trie_nodes);
+	trie_nodes = NULL;
+	free(rule_duplicates);
+	band_rules_free(band_rules, total_rules);
+	band_rules = NULL;
+	root_node = NULL;
+
+	total_nodes = leaf_nodes = max_depth = 0;
+	memset(depth_nodes, 0, sizeof(depth_nodes));
+	memset(depth_leaf_nodes, 0, sizeof(depth_leaf_nodes));
+	memset(depth_max_node, 0, sizeof(depth_max_node));
+	memset(cut_efficiency, 0, sizeof(cut_efficiency));
+	memset(cut_score_sum, 0, sizeof(cut_score_sum));
+	memset(cut_nodes, 0, sizeof(cut_nodes));
+	cuts_tried = rules_pruned = nodes_dedup = 0;
+}
+
+
+
+Rule* classify(Trie *root, Packet *pkt)
+{
+	return lookup(root, band_rules, &leaf_pool, pkt);
+}
+
+
+
+#ifdef LOOKUP_STATS
+// #cache lines spanned by bytes at p
+int cache_lines(void *p, size_t bytes)
+{
+	return ((uintptr_t) p + bytes - 1) / 64 - (uintptr_t) p / 64 + 1;
+}
+
+
+
+// cache lines of a rule in ternary form, when all its fields are compared
+int band_rule_lines(BandRule *brule)
+{
+	int		dim, n = cache_lines(brule, sizeof(BandRule));
+
+	for (dim = 0; dim < NFIELDS; dim++)
+		n += cache_lines(brule->tbits[dim], brule->ntbits[dim] * sizeof(TBits));
+	return n;
+}
+
+
+
+void lookup_record(int depth, int nrules, int cover, int lines)
+{
+	__atomic_fetch_add(&lookup_stats.lookups, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&lookup_stats.cover, cover, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&lookup_stats.depth[depth], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&lookup_stats.rules[nrules < LOOKUP_HIST ? nrules : LOOKUP_HIST-1], 1,
+			__ATOMIC_RELAXED);
+	__atomic_fetch_add(&lookup_stats.lines[lines < LOOKUP_HIST ? lines : LOOKUP_HIST-1], 1,
+			__ATOMIC_RELAXED);
+}
+#endif
+
+
+
+/******************************************************************************
+ *
+ * Section for packed leaf rule lists
+ *
+ *****************************************************************************/
+
+typedef struct {
+	uint64_t	hash;
+	int			first, n;		// ids first .. first+n-1 of the pool, n = 0 for an empty slot
+} IdList;
+
+uint64_t	leaf_ids_size;
+IdList		*id_lists;
+int			id_lists_size;
+
+// paths walked to narrow the leaves
+Band		path_cuts[MAX_DEPTH];		// cut taken at each depth
+uint32_t	*path_points[MAX_DEPTH];	// range cut points of the node at each depth
+Range		**leaf_strip;				// by node id: the leaf rule fields stripped on a path
+int8_t		*leaf_strip_ok;				// by node id: 1 when every path strips them the same
+
+
+
+uint64_t id_hash(Rule **rules, int n)
+{
+	uint64_t	h = n;
+	int			i;
+
+	for (i = 0; i < n; i++)
+		h = (h ^ rules[i]->id) * 0x100000001B3ULL;
+	return h ^ h >> 29;
+}
+
+
+
+inline uint32_t leaf_id(LeafPool *pool, void *ids, int i)
+{
+	return pool->id_bytes == 2 ? ((uint16_t *) ids)[i] : ((uint32_t *) ids)[i];
+}
+
+
+
+// offset in the pool of the list of the ids of rules, added when new
+int intern_ids(Rule **rules, int n, uint64_t *used)
+{
+	IdList		*l;
+	uint64_t	hash = id_hash(rules, n);
+	int			i;
+
+	for (l = &id_lists[hash & (id_lists_size - 1)]; l->n > 0; ) {
+		if (l->hash == hash && l->n == n) {
+			for (i = 0; i < n && leaf_id(&leaf_pool, (char *) leaf_pool.ids + l->first * leaf_pool.id_bytes, i)
+					== rules[i]->id; i++)
+				;
+			if (i == n)
+				return l->first;
+		}
+		l = l == &id_lists[id_lists_size - 1] ? id_lists : l + 1;
+	}
+	if (*used + n > leaf_ids_size) {
+		leaf_ids_size = 2 * (*used + n);
+		leaf_pool.ids = realloc(leaf_pool.ids, leaf_ids_size * leaf_pool.id_bytes);
+	}
+	for (i = 0; i < n; i++) {
+		if (leaf_pool.id_bytes == 2)
+			((uint16_t *) leaf_pool.ids)[*used + i] = rules[i]->id;
+		else
+			((uint32_t *) leaf_pool.ids)[*used + i] = rules[i]->id;
+	}
+	l->hash = hash;
+	l->n = n;
+	l->first = *used;
+	*used += n;
+	return l->first;
+}
+
+
+
+// the rule ids of a packed leaf
+inline void* leaf_id_list(LeafPool *pool, Trie *v)
+{
+	return pool->narrow ? ((LeafBounds *) v->ids)->ids : v->ids;
+}
+
+
+
+// strip the rules of each leaf along every path to it; a leaf shared by siblings may be
+// stripped apart by them, and is then matched on the rule boxes
+void strip_paths(Trie *v)
+{
+	Range	f[NFIELDS], *s;
+	int		val, idx, depth, i, ok = 1;
+
+	if (v->nchildren == 0) {
+		if (v->nrules == 0 || leaf_strip_ok[v->id] < 0)
+			return;
+		if ((s = leaf_strip[v->id]) == NULL)
+			s = leaf_strip[v->id] = malloc(v->nrules * NFIELDS * sizeof(Range));
+		for (i = 0; i < v->nrules && ok; i++) {
+			memcpy(f, v->rules[i]->field, sizeof(f));
+			for (depth = 1; depth <= v->depth && ok; depth++)
+				ok = cut_range(&f[path_cuts[depth].dim], &path_cuts[depth], path_points[depth-1]);
+			if (leaf_strip_ok[v->id] == 0)
+				memcpy(&s[i * NFIELDS], f, sizeof(f));
+			else
+				ok = ok && memcmp(&s[i * NFIELDS], f, sizeof(f)) == 0;
+		}
+		leaf_strip_ok[v->id] = ok ? 1 : -1;
+		return;
+	}
+	path_points[v->depth] = v->points;
+	for (val = 0; val < BAND_SIZE; val++) {
+		if ((idx = child_index(v, val)) < 0)
+			continue;
+		path_cuts[v->depth+1] = v->split;
+		path_cuts[v->depth+1].val = val;
+		strip_paths(&v->children[idx]);
+	}
+}
+
+
+
+inline void set_lane(uint8_t *p, int width, int i, uint32_t a)
+{
+	a ^= 1U << (8 * width - 1);
+	if (width == 1)
+		p[i] = a;
+	else if (width == 2)
+		((uint16_t *) p)[i] = a;
+	else
+		((uint32_t *) p)[i] = a;
+}
+
+
+
+// the LeafBounds of leaf v over its ids list, narrowed when all its paths strip it the same
+LeafBounds* narrow_leaf(Trie *v, void *ids, uint64_t *bytes)
+{
+	LeafBounds	*lb;
+	Range		*s = leaf_strip[v->id];
+	uint32_t	base[NFIELDS] = {0}, top;
+	uint8_t		width[NFIELDS] = {0}, *p;
+	size_t		block = 0;
+	int			nblocks = 0, b, dim, i, k, w;
+
+	if (leaf_strip_ok[v->id] > 0) {
+		for (dim = 0; dim < NFIELDS; dim++) {
+			base[dim] = UINT32_MAX;
+			top = 0;
+			for (i = 0; i < v->nrules; i++) {
+				if (s[i * NFIELDS + dim].lo < base[dim])
+					base[dim] = s[i * NFIELDS + dim].lo;
+				if (s[i * NFIELDS + dim].hi > top)
+					top = s[i * NFIELDS + dim].hi;
+			}
+			width[dim] = top - base[dim] <= 0xFF ? 1 : top - base[dim] <= 0xFFFF ? 2 : 4;
+			if (width[dim] == 4)
+				base[dim] = 0;
+			block += 2 * NARROW_BLOCK * width[dim];
+		}
+		nblocks = (v->nrules + NARROW_BLOCK - 1) / NARROW_BLOCK;
+	}
+	lb = aligned_alloc(16, sizeof(LeafBounds) + nblocks * block);
+	lb->ids = ids;
+	memcpy(lb->base, base, sizeof(base));
+	memcpy(lb->width, width, NFIELDS);
+	lb->nblocks = nblocks;
+	lb->block_bytes = block;
+	*bytes += sizeof(LeafBounds) + nblocks * block;
+
+	p = (uint8_t *) (lb + 1);
+	for (b = 0; b < nblocks; b++) {
+		for (dim = 0; dim < NFIELDS; dim++) {
+			w = width[dim];
+			for (k = 0; k < NARROW_BLOCK; k++) {
+				i = b * NARROW_BLOCK + k;
+				// lanes past the rules never match: lo above hi
+				set_lane(p, w, k, i < v->nrules ? s[i * NFIELDS + dim].lo - base[dim] : UINT32_MAX);
+				set_lane(p + NARROW_BLOCK * w, w, k, i < v->nrules ? s[i * NFIELDS + dim].hi - base[dim] : 0);
+			}
+			p += 2 * NARROW_BLOCK * w;
+		}
+	}
+	return lb;
+}
+
+
+
+// replace the Rule* lists of the leaves of the trie just built by 16-bit (or 32-bit with more
+// than 65536 rules) rule ids in a pool of shared lists, and make the dense rule copy they are
+// matched against. The leaves rebuilt later keep Rule* lists. With narrow, the leaves also
+// get their rules stripped along the path in lanes as wide as the bits left of each field.
+void pack_leaves(int narrow)
+{
+	Trie		*v;
+	Rule		*r;
+	void		*ids;
+	int			*first, nleaves = 0, nnarrow = 0, i, dim;
+	uint64_t	used = 0, listed = 0, bounds_bytes = 0;
+
+	RuleBox		*boxes = aligned_alloc(16, total_rules * sizeof(RuleBox));
+
+	for (i = 0; i < total_rules; i++) {
+		r = band_rules[i].rule;
+		for (dim = 0; dim < 4; dim++) {
+			boxes[i].lo[dim] = r->field[dim].lo ^ SIGN_BIAS;
+			boxes[i].hi[dim] = r->field[dim].hi ^ SIGN_BIAS;
+		}
+		boxes[i].proto_lo = r->field[4].lo;
+		boxes[i].proto_hi = r->field[4].hi;
+	}
+	leaf_pool.boxes = boxes;
+	leaf_pool.nboxes = total_rules;
+
+	leaf_pool.id_bytes = total_rules <= 65536 ? 2 : 4;
+	for (id_lists_size = 16; id_lists_size < 2 * total_nodes; id_lists_size *= 2)
+		;
+	id_lists = calloc(id_lists_size, sizeof(IdList));
+	first = malloc(total_nodes * sizeof(int));
+	for (i = 0; i < total_nodes; i++) {
+		v = trie_nodes[i];
+		if (v->nchildren == 0 && v->nrules > 0) {
+			first[i] = intern_ids(v->rules, v->nrules, &used);
+			listed += v->nrules;
+			nleaves++;
+		}
+	}
+	leaf_pool.ids = realloc(leaf_pool.ids, used * leaf_pool.id_bytes);
+	leaf_pool.nids = used;
+
+	if (narrow) {
+		leaf_strip = calloc(total_nodes, sizeof(Range *));
+		leaf_strip_ok = calloc(total_nodes, sizeof(int8_t));
+		strip_paths(trie_nodes[0]);
+	}
+
+	// the pool does not move any more
+	for (i = 0; i < total_nodes; i++) {
+		v = trie_nodes[i];
+		if (v->nchildren == 0 && v->nrules > 0) {
+			ids = (char *) leaf_pool.ids + first[i] * leaf_pool.id_bytes;
+			if (narrow) {
+				nnarrow += leaf_strip_ok[i] > 0;
+				ids = narrow_leaf(v, ids, &bounds_bytes);
+				free(leaf_strip[i]);
+			}
+			v->ids = ids;
+			free(v->rules);
+			v->rules = NULL;
+		}
+	}
+	leaf_pool.narrow = narrow;
+	printf("packed leaves: %d leaves, %lu ids of %d bytes for %lu bytes of Rule* lists, "
+			"%d rule boxes of %lu bytes\n", nleaves, used, leaf_pool.id_bytes, listed * sizeof(Rule *),
+			total_rules, sizeof(RuleBox));
+	if (narrow) {
+		printf("narrowed leaves: %d of %d leaves, %lu bytes of leaf bounds\n",
+				nnarrow, nleaves, bounds_bytes);
+		free(leaf_strip);
+		free(leaf_strip_ok);
+	}
+	free(first);
+	free(id_lists);
+}
+
+
+
+// the rules of a leaf as a Rule* list, unpacked into v->rules for a packed leaf
+Rule** unpack_leaf(Trie *v)
+{
+	int		i;
+
+	if (v->rules == NULL && v->ids != NULL) {
+		v->rules = malloc(v->nrules * sizeof(Rule *));
+		for (i = 0; i < v->nrules; i++)
+			v->rules[i] = band_rules[leaf_id(&leaf_pool, leaf_id_list(&leaf_pool, v), i)].rule;
+	}
+	return v->rules;
+}
+
+
+
+inline int box_match(RuleBox *b, Packet *pkt)
+{
+#ifdef __SSE2__
+	__m128i	key = _mm_xor_si128(_mm_loadu_si128((__m128i *) pkt->field), _mm_set1_epi32(SIGN_BIAS));
+	__m128i	out = _mm_or_si128(_mm_cmplt_epi32(key, _mm_load_si128((__m128i *) b->lo)),
+							   _mm_cmpgt_epi32(key, _mm_load_si128((__m128i *) b->hi)));
+
+	return _mm_movemask_epi8(out) == 0
+		&& pkt->field[4] >= b->proto_lo && pkt->field[4] <= b->proto_hi;
+#else
+	int		dim;
+
+	for (dim = 0; dim < 4; dim++) {
+		if (pkt->field[dim] < (b->lo[dim] ^ SIGN_BIAS) || pkt->field[dim] > (b->hi[dim] ^ SIGN_BIAS))
+			return 0;
+	}
+	return pkt->field[4] >= b->proto_lo && pkt->field[4] <= b->proto_hi;
+#endif
+}
+
+
+
+// fail mask of the NARROW_BLOCK lanes of a field: bit k set when the key is out of lane k
+inline int lane_fail(uint8_t *p, int width, uint32_t key)
+{
+#ifdef __SSE2__
+	__m128i	k, x, lo, hi;
+
+	key ^= 1U << (8 * width - 1);
+	if (width == 1) {
+		// the lo lanes in the low half of x, the hi lanes in the high half
+		k = _mm_set1_epi8(key);
+		x = _mm_load_si128((__m128i *) p);
+		return (_mm_movemask_epi8(_mm_cmpgt_epi8(x, k)) | _mm_movemask_epi8(_mm_cmpgt_epi8(k, x)) >> 8) & 0xFF;
+	}
+	if (width == 2) {
+		k = _mm_set1_epi16(key);
+		x = _mm_or_si128(_mm_cmpgt_epi16(_mm_load_si128((__m128i *) p), k),
+						 _mm_cmpgt_epi16(k, _mm_load_si128((__m128i *) p + 1)));
+		return _mm_movemask_epi8(_mm_packs_epi16(x, x)) & 0xFF;
+	}
+	k = _mm_set1_epi32(key);
+	lo = _mm_or_si128(_mm_cmpgt_epi32(_mm_load_si128((__m128i *) p), k),
+					  _mm_cmpgt_epi32(k, _mm_load_si128((__m128i *) p + 2)));
+	hi = _mm_or_si128(_mm_cmpgt_epi32(_mm_load_si128((__m128i *) p + 1), k),
+					  _mm_cmpgt_epi32(k, _mm_load_si128((__m128i *) p + 3)));
+	x = _mm_packs_epi32(lo, hi);
+	return _mm_movemask_epi8(_mm_packs_epi16(x, x)) & 0xFF;
+#else
+	uint32_t	lo, hi;
+	int			fail = 0, i;
+
+	for (i = 0; i < NARROW_BLOCK; i++) {
+		if (width == 1) {
+			lo = p[i];
+			hi = p[NARROW_BLOCK + i];
+		} else if (width == 2) {
+			lo = ((uint16_t *) p)[i];
+			hi = ((uint16_t *) p)[NARROW_BLOCK + i];
+		} else {
+			lo = ((uint32_t *) p)[i];
+			hi = ((uint32_t *) p)[NARROW_BLOCK + i];
+		}
+		lo ^= 1U << (8 * width - 1);
+		hi ^= 1U << (8 * width - 1);
+		fail |= (key < lo || key > hi) << i;
+	}
+	return fail;
+#endif
+}
+
+
+
+// index of the first rule of a narrowed leaf matching the stripped key, -1 if none
+inline int bounds_match(LeafBounds *lb, uint32_t *key)
+{
+	uint32_t	k[NFIELDS];
+	uint8_t		*p = (uint8_t *) (lb + 1), *q;
+	int			b, dim, fail;
+
+	// a key off the span of the leaf is in no lane
+	for (dim = 0; dim < NFIELDS; dim++) {
+		k[dim] = key[dim] - lb->base[dim];
+		if (lb->width[dim] < 4 && k[dim] >> 8 * lb->width[dim] != 0)
+			return -1;
+	}
+	for (b = 0; b < lb->nblocks; b++, p += lb->block_bytes) {
+		fail = 0;
+		q = p;
+		for (dim = 0; dim < NFIELDS && fail != (1 << NARROW_BLOCK) - 1; dim++) {
+			fail |= lane_fail(q, lb->width[dim], k[dim]);
+			q += 2 * NARROW_BLOCK * lb->width[dim];
+		}
+		if (fail != (1 << NARROW_BLOCK) - 1)
+			return b * NARROW_BLOCK + __builtin_ctz(~fail);
+	}
+	return -1;
+}
+
+
+
+// walk down the trie with the band values of the packet (stripped the same way as the rules
+// along the path), then match the node rules with masked compares on their ternary form, or
+// with range compares on the rule boxes of pool for a packed leaf (pool is not read when no
+// leaf is packed); *end is the node where the walk stopped. Reads nothing but the trie, the
+// rules and the pool.
+Rule* descend(Trie *root, BandRule *brules, LeafPool *pool, Packet *pkt, Trie **end)
+{
+	Trie		*v = root;
+	LeafBounds	*lb;
+	void		*ids;
+	uint32_t	key[NFIELDS], val, id;
+	int			dim, i;
+	LSTAT(int	lines = 0);
+
+	for (dim = 0; dim < NFIELDS; dim++)
+		key[dim] = pkt->field[dim];
+
+	// nchildren and children may be republished by rebuild_node() and hot_layout()
+	while (__atomic_load_n(&v->nchildren, __ATOMIC_ACQUIRE) > 0) {
+		LSTAT(lines += cache_lines(v, sizeof(Trie)));
+		dim = v->split.dim;
+		if (v->split.bid == RANGE_BID) {
+			LSTAT(lines += cache_lines(v->points, POINTS_BYTES));
+			val = range_value(key[dim], v->points);
+		} else {
+			val = extract_bits(key[dim], band_msb(v->split.bid), band_lsb(v->split.bid));
+			key[dim] = band_strip(key[dim], v->split.bid);
+		}
+		*end = v;
+		if (!(v->present >> val & 1)) {
+			LSTAT(lookup_record(v->depth, 0, 1, lines));
+			return v->full_cover;	// no rules in this cut space other than the default
+		}
+		v = &__atomic_load_n(&v->children, __ATOMIC_ACQUIRE)[v->cindex >> 4 * val & 0xF];
+	}
+	*end = v;
+	if (v->ids != NULL && pool->narrow && ((LeafBounds *) v->ids)->nblocks > 0) {
+		lb = v->ids;
+		LSTAT(lines += cache_lines(v, sizeof(Trie)) + cache_lines(lb, sizeof(LeafBounds)));
+		i = bounds_match(lb, key);
+		LSTAT(lines += cache_lines(lb + 1, (i < 0 ? lb->nblocks : i / NARROW_BLOCK + 1)
+					* (size_t) (lb->width[0] + lb->width[1] + lb->width[2] + lb->width[3]
+					+ lb->width[4]) * 2 * NARROW_BLOCK));
+		if (i >= 0) {
+			LSTAT(lines += cache_lines(lb->ids, pool->id_bytes));
+			LSTAT(lookup_record(v->depth, i + 1, 0, lines));
+			return brules[leaf_id(pool, lb->ids, i)].rule;
+		}
+		LSTAT(lookup_record(v->depth, v->nrules, 1, lines));
+		return v->full_cover;
+	}
+	if (v->ids != NULL) {
+		ids = leaf_id_list(pool, v);
+		LSTAT(lines += cache_lines(v, sizeof(Trie)) + cache_lines(ids, v->nrules * pool->id_bytes));
+		for (i = 0; i < v->nrules; i++) {
+			id = leaf_id(pool, ids, i);
+			LSTAT(lines += cache_lines(&pool->boxes[id], sizeof(RuleBox)));
+			if (box_match(&pool->boxes[id], pkt)) {
+				LSTAT(lookup_record(v->depth, i + 1, 0, lines));
+				return brules[id].rule;
+			}
+		}
+		LSTAT(lookup_record(v->depth, v->nrules, 1, lines));
+		return v->full_cover;
+	}
+	LSTAT(lines += cache_lines(v, sizeof(Trie)) + cache_lines(v->rules, v->nrules * sizeof(Rule *)));
+
+	for (i = 0; i < v->nrules; i++) {
+		LSTAT(lines += cache_lines(v->rules[i], sizeof(Rule)) + band_rule_lines(&brules[v->rules[i]->id]));
+		if (band_rule_match(&brules[v->rules[i]->id], pkt)) {
+			LSTAT(lookup_record(v->depth, i + 1, 0, lines));
+			return v->rules[i];
+		}
+	}
+	LSTAT(lookup_record(v->depth, v->nrules, 1, lines));
+	return v->full_cover;
+}
+
+
+
+// add a match to out, kept sorted: the max of the lowest ids, or of the lowest priorities
+// (then ids) when topk
+inline
+void add_match(Rule **out, int n, int max, int topk, Rule *r)
+{
+	int		i;
+
+	i = n < max ? n : max;
+	for (; i > 0; i--) {
+		if (topk && out[i-1]->priority != r->priority) {
+			if (out[i-1]->priority < r->priority)
+				break;
+		} else if (out[i-1]->id < r->id)
+			break;
+		if (i < max)
+			out[i] = out[i-1];
+	}
+	if (i < max)
+		out[i] = r;
+}
+
+
+
+// multi-match on a trie built with set_multi_match(1): the cover lists along the path hold the
+// rules matching everything below, the last node adds its matching rules. Store the matching
+// rules in id order (the max of the lowest ids), or the max of the lowest priority when topk;
+// return #matching rules
+int lookup_multi(Trie *root, BandRule *brules, Packet *pkt, Rule **out, int max, int topk)
+{
+	Trie		*v = root;
+	uint32_t	key[NFIELDS], val;
+	int			dim, i, n = 0;
+
+	for (dim = 0; dim < NFIELDS; dim++)
+		key[dim] = pkt->field[dim];
+
+	while (1) {
+		for (i = 0; i < v->ncovers; i++)
+			add_match(out, n++, max, topk, v->covers[i]);
+		if (__atomic_load_n(&v->nchildren, __ATOMIC_ACQUIRE) == 0)
+			break;
+		dim = v->split.dim;
+		if (v->split.bid == RANGE_BID) {
+			val = range_value(key[dim], v->points);
+		} else {
+			val = extract_bits(key[dim], band_msb(v->split.bid), band_lsb(v->split.bid));
+			key[dim] = band_strip(key[dim], v->split.bid);
+		}
+		if (!(v->present >> val & 1))
+			return n;
+		v = &__atomic_load_n(&v->children, __ATOMIC_ACQUIRE)[v->cindex >> 4 * val & 0xF];
+	}
+
+	for (i = 0; i < v->nrules; i++) {
+		if (band_rule_match(&brules[v->rules[i]->id], pkt))
+			add_match(out, n++, max, topk, v->rules[i]);
+	}
+	return n;
+}
+
+
+
+// descend() counting the node where the lookup ends when hit sampling is on
+Rule* lookup(Trie *root, BandRule *brules, LeafPool *pool, Packet *pkt)
+{
+	Trie	*end;
+	Rule	*r = descend(root, brules, pool, pkt, &end);
 
-	dump_stats();
+	HIT_SAMPLE(end);
+	return r;
 }
 
 
@@ -1,37 +1,161 @@
 #ifndef TRIE_H
 #define TRIE_H
 
+#include <stdio.h>
 #include "bitband.h"
 #include "rule.h"
 
 #define MAX_CHILDREN	BAND_SIZE
 #define	SMALL_NODE		16			// node is small with rules less than this
-#define MAX_DEPTH		16
+#define MAX_DEPTH		32
+#define BAND_DEPTH		16			// depth limit of the band and equal range cut tries
+#define RANGE_BID		15			// bid of a range cut
+#define RANGE_POINTS	(MAX_CHILDREN-1)
+#define POINTS_BYTES	(RANGE_POINTS * sizeof(uint32_t))
 
 
 enum { LEAF, NONLEAF };
 
 typedef struct trie_t	Trie;
 
+// the fields a lookup reads come first, together within a cache line
 struct trie_t {
-	int			id;				// global id in the trie
+	int			nchildren;
+	Band		split;				// cut partitioning my children (val unused)
+	uint16_t	present;			// bit of each cut value with a child
 	uint8_t		depth;
-	int			child_id;		// id among its siblings of the same parent
 	uint8_t		type;
-	uint16_t	nequals;		// number of equal nodes pointing to me
 	int			nrules;
-	Rule**		rules;
-	Rule*		full_cover;		
+	uint64_t	cindex;				// 4-bit index in children of each present cut value,
+									// equal for the values sharing a child
+	uint32_t	*points;			// range cut: child val starts at points[val-1], padded
+									// with UINT32_MAX; NULL for a band cut
+	Trie*		children;			// distinct children only, NULL for a leaf
+	Rule*		full_cover;
+	Rule**		rules;				// NULL for a packed leaf
+	void		*ids;				// packed leaf: its rule ids in the LeafPool, or its LeafBounds
+									// when narrowed; NULL otherwise
 
-	Trie*		parent;
+	int			id;				// global id in the trie
+	int			child_id;		// id among its siblings of the same parent
+	uint16_t	nequals;		// number of equal nodes pointing to me
 	Band		cut;
-
-	int			nchildren;
-	Trie*		children;
+	Trie*		parent;
+	int			ncovers;			// multi-match: rules covering my space, not in rules
+	Rule**		covers;
+	int			npruners;			// set_keep_pruners(): the rules that dropped a rule from
+	Rule**		pruners;			// mine as covered, by id
 };
 
 
+// statistics of a candidate cut, input to the cut scoring function
+typedef struct {
+	int			max_rules;		// #rules of the largest child
+	int			total_rules;	// sum of #rules of all children (rule replication)
+	int			nchildren;		// #non-empty children
+	double		entropy;		// entropy (bits) of the rule distribution among children
+	int			npkts;			// #sampled packets reaching the node
+	long		pkt_rules;		// sum of #rules of the child each sampled packet falls in
+} CutStat;
+
+// score of a candidate cut at node v, the cut with the lowest score is chosen
+typedef double (*CutScore)(Trie *v, CutStat *st);
+
+int set_cut_objective(char *name, double weight);
+int set_cut_strategy(char *name);
+char* cut_strategy_name(int i);
+void set_cut_score(CutScore score);
+void set_cut_samples(Packet *packets, int npackets);
+void set_multi_match(int on);
+void set_keep_pruners(int on);
+void set_build_report(int on);
+
+// lookup path histograms, compiled in with -DLOOKUP_STATS (make stats) and out otherwise
+#define LOOKUP_HIST		64			// last bin counts everything beyond
+
+typedef struct {
+	uint64_t	lookups;
+	uint64_t	cover;					// decided by the full cover of a node
+	uint64_t	depth[MAX_DEPTH];		// depth of the node where the lookup ends
+	uint64_t	rules[LOOKUP_HIST];		// #leaf rules compared
+	uint64_t	lines[LOOKUP_HIST];		// #cache lines touched
+} LookupStats;
+
+#ifdef LOOKUP_STATS
+#define LSTAT(x)	x
+#else
+#define LSTAT(x)
+#endif
+
+extern LookupStats	lookup_stats;
+
+// a rule as ranges for packed leaves: the 4 first fields biased by 2^31 to be compared as
+// signed 32-bit lanes, then the protocol
+typedef struct {
+	uint32_t	lo[4];
+	uint32_t	hi[4];
+	uint32_t	proto_lo, proto_hi;
+} __attribute__((aligned(16))) RuleBox;
+
+// narrowed packed leaf: the rule fields stripped along the path, less the lowest bound of
+// the leaf, in blocks of NARROW_BLOCK rules. A block has the lo lanes then the hi lanes of
+// each field in turn, lanes of the fewest bytes holding the field span, biased like RuleBox
+#define NARROW_BLOCK	8
+
+typedef struct {
+	void		*ids;				// the rule ids of the leaf in the LeafPool
+	uint32_t	base[NFIELDS];		// lowest stripped bound of each field, 0 for 4-byte lanes
+	uint8_t		width[NFIELDS];		// bytes of the lanes of each field
+	uint16_t	nblocks;			// 0 when not narrowed: matched on the rule boxes
+	uint16_t	block_bytes;
+} __attribute__((aligned(16))) LeafBounds;
+
+// the packed leaf data of a trie, read by its lookups through the image holding it; the
+// leaves point into ids, directly or through their LeafBounds
+typedef struct {
+	RuleBox		*boxes;				// by rule id
+	void		*ids;				// the id lists, of id_bytes ids
+	uint64_t	nids;
+	int			nboxes;
+	int			id_bytes;
+	int			narrow;				// the leaves point to LeafBounds
+} LeafPool;
+
+extern int		total_nodes, total_rules;
+extern Trie		**trie_nodes;
+extern BandRule	*band_rules;
+extern LeafPool	leaf_pool;
+extern uint32_t	trie_generation;
+extern int		build_cancel;
+
 Trie* build_trie(Rule *rules, int nrules, int leaf_rules);
+void free_trie(Trie *root);
+void pack_leaves(int narrow);
+Rule** unpack_leaf(Trie *v);
+void build_reset();
+int rebuild_node(Trie *v, int leaf_rules);
+void update_roots(Trie *root, Rule *rule, Trie ***roots, int *n, int *size);
+void update_path(Trie *root, Rule *rule, Trie ***nodes, int *n, int *size);
+int pruned_by(Trie *u, Rule *rule);
+void refill_rules(Trie *v, Rule **rules, int nrules);
+int subtree_nodes(Trie *v);
+int rebuild_subtree(Trie *v, Rule **rules, int nrules, int leaf_rules, Trie *w);
+Trie* replace_node(Trie *v, Trie *w, Trie **root);
+void drop_subtree(Trie *v);
+void free_node(Trie *v);
+int cmp_rule_id(const void *a, const void *b);
+void relink_children(Trie *v);
+inline
+int child_index(Trie *v, int val);
+inline
+void set_child(Trie *v, int val, int index);
+inline
+int range_value(uint32_t key, uint32_t *points);
+int cut_range(Range *r, Band *cut, uint32_t *points);
+Rule* descend(Trie *root, BandRule *brules, LeafPool *pool, Packet *pkt, Trie **end);
+Rule* lookup(Trie *root, BandRule *brules, LeafPool *pool, Packet *pkt);
+Rule* classify(Trie *root, Packet *pkt);
+int lookup_multi(Trie *root, BandRule *brules, Packet *pkt, Rule **out, int max, int topk);
 
 void dump_trie(Trie *root, int detail);
 void dump_node(Trie *v, int simple);
@@ -40,6 +164,10 @@ void dump_nodes(int max, int min);
 void dump_rules(Rule **rules, int nrules);
 void dump_path(Trie *v, int detail);
 void dump_stats();
+void dump_json(FILE *fp);
+void dump_bench(FILE *fp, char *name, double mpps);
+void dump_quality(FILE *fp);
+void dump_lookup_stats(FILE *fp, int json);
 
 
 #endif
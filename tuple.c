@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tuple.h"
+
+
+
+// the rules of a tuple together, and in it the rules of an address pair in id order; the lo
+// end of a prefix is its masked address
+int cmp_tuple_rule(const void *a, const void *b)
+{
+	Rule	*x = *(Rule **) a, *y = *(Rule **) b;
+	int		dim;
+
+	for (dim = 0; dim < 2; dim++) {
+		if (x->prefix[dim] != y->prefix[dim])
+			return x->prefix[dim] - y->prefix[dim];
+	}
+	for (dim = 0; dim < 2; dim++) {
+		if (x->field[dim].lo != y->field[dim].lo)
+			return x->field[dim].lo < y->field[dim].lo ? -1 : 1;
+	}
+	return x->id - y->id;
+}
+
+
+
+int cmp_tuple_first(const void *a, const void *b)
+{
+	return ((Tuple *) a)->first_id - ((Tuple *) b)->first_id;
+}
+
+
+
+// slot of the bucket of an address pair in t, or the empty slot it goes to
+inline uint32_t tuple_slot(Tuple *t, uint32_t a0, uint32_t a1)
+{
+	uint32_t	h = hull_hash(a0, t->bits[0], a1, t->bits[1]) & t->mask;
+	int			b;
+
+	for (; (b = t->slots[h]) != -1; h = (h + 1) & t->mask) {
+		if (t->buckets[b].addr[0] == a0 && t->buckets[b].addr[1] == a1)
+			break;
+	}
+	return h;
+}
+
+
+
+// build the port tree of a bucket in the store, its rules renumbered 0 .. nrules-1; a pooled
+// rule maps back to the first rule of the bucket equal to it
+int bucket_tree(TupleSpace *sp, TupleBucket *b, int leaf_rules)
+{
+	Rule	*copy = malloc(b->nrules * sizeof(Rule)), **pooled = malloc(b->nrules * sizeof(Rule *));
+	int		tree, i;
+
+	for (i = 0; i < b->nrules; i++) {
+		copy[i] = *b->rules[i];
+		copy[i].id = i;
+	}
+	tree = tenants_add(sp->trees, copy, b->nrules, leaf_rules, pooled);
+	for (i = 0; i < b->nrules; i++) {
+		if (sp->origin[pooled[i]->id] == NULL)
+			sp->origin[pooled[i]->id] = b->rules[i];
+	}
+	free(copy);
+	free(pooled);
+	sp->ntrees++;
+	return tree;
+}
+
+
+
+// add the tuple of rules, sorted by cmp_tuple_rule()
+void tuple_add(TupleSpace *sp, Rule **rules, int nrules, int leaf_rules)
+{
+	TupleBucket	*b;
+	Tuple		*t;
+	int			nbuckets = 1, i, j;
+
+	for (i = 1; i < nrules; i++)
+		nbuckets += rules[i-1]->field[0].lo != rules[i]->field[0].lo ||
+				rules[i-1]->field[1].lo != rules[i]->field[1].lo;
+
+	sp->tuples = realloc(sp->tuples, (sp->ntuples + 1) * sizeof(Tuple));
+	t = &sp->tuples[sp->ntuples++];
+	t->bits[0] = rules[0]->prefix[0];
+	t->bits[1] = rules[0]->prefix[1];
+	t->first_id = rules[0]->id;
+	for (t->mask = 1; t->mask < 2 * nbuckets; t->mask <<= 1)
+		;
+	t->slots = malloc(t->mask * sizeof(int));
+	memset(t->slots, -1, t->mask * sizeof(int));
+	t->mask--;
+	t->buckets = malloc(nbuckets * sizeof(TupleBucket));
+	t->nbuckets = 0;
+
+	for (i = 0; i < nrules; i = j) {
+		for (j = i + 1; j < nrules && rules[j]->field[0].lo == rules[i]->field[0].lo &&
+				rules[j]->field[1].lo == rules[i]->field[1].lo; j++)
+			;
+		b = &t->buckets[t->nbuckets];
+		b->addr[0] = rules[i]->field[0].lo;
+		b->addr[1] = rules[i]->field[1].lo;
+		b->nrules = j - i;
+		b->rules = malloc(b->nrules * sizeof(Rule *));
+		memcpy(b->rules, &rules[i], b->nrules * sizeof(Rule *));
+		if (b->rules[0]->id < t->first_id)
+			t->first_id = b->rules[0]->id;
+		b->tree = -1;
+		if (b->nrules > leaf_rules) {
+			b->tree = bucket_tree(sp, b, leaf_rules);
+			free(b->rules);
+			b->rules = NULL;
+		}
+		t->slots[tuple_slot(t, b->addr[0], b->addr[1])] = t->nbuckets++;
+	}
+	sp->nbuckets += t->nbuckets;
+}
+
+
+
+// the tuple space of a rule set (ids 0 .. nrules-1), which is referred to by the lookups
+TupleSpace* tuples_new(Rule *rules, int nrules, int leaf_rules, int huge)
+{
+	TupleSpace	*sp = calloc(1, sizeof(TupleSpace));
+	Rule		**sorted = malloc(nrules * sizeof(Rule *));
+	int			i, j;
+
+	for (i = 0; i < nrules; i++)
+		sorted[i] = &rules[i];
+	qsort(sorted, nrules, sizeof(Rule *), cmp_tuple_rule);
+	sp->nrules = nrules;
+	sp->trees = tenants_new(huge);
+	sp->origin = calloc(nrules, sizeof(Rule *));
+	set_build_report(0);
+
+	for (i = 0; i < nrules; i = j) {
+		for (j = i + 1; j < nrules && sorted[j]->prefix[0] == sorted[i]->prefix[0] &&
+				sorted[j]->prefix[1] == sorted[i]->prefix[1]; j++)
+			;
+		tuple_add(sp, &sorted[i], j - i, leaf_rules);
+	}
+	qsort(sp->tuples, sp->ntuples, sizeof(Tuple), cmp_tuple_first);
+	free(sorted);
+	return sp;
+}
+
+
+
+void tuples_free(TupleSpace *sp)
+{
+	Tuple	*t;
+	int		i, j;
+
+	for (i = 0; i < sp->ntuples; i++) {
+		t = &sp->tuples[i];
+		for (j = 0; j < t->nbuckets; j++)
+			free(t->buckets[j].rules);
+		free(t->buckets);
+		free(t->slots);
+	}
+	free(sp->tuples);
+	free(sp->origin);
+	tenants_free(sp->trees);
+	free(sp);
+}
+
+
+
+// probe the tuples in the order of their first rule until none can hold a rule before the
+// best match; a bucket is searched up to the best match too
+inline Rule* tuples_lookup(TupleSpace *sp, Packet *pkt)
+{
+	TupleBucket	*b;
+	Tuple		*t;
+	Rule		*best = NULL, *r;
+	uint32_t	a0, a1;
+	int			i, j, s;
+
+	LSTAT(sp->lookups++);
+	for (i = 0; i < sp->ntuples; i++) {
+		t = &sp->tuples[i];
+		if (best != NULL && best->id < t->first_id)
+			break;
+		LSTAT(sp->probes++);
+		a0 = pkt->field[0] & prefix_mask(t->bits[0]);
+		a1 = pkt->field[1] & prefix_mask(t->bits[1]);
+		if ((s = t->slots[tuple_slot(t, a0, a1)]) == -1)
+			continue;
+		b = &t->buckets[s];
+		if (b->tree >= 0) {
+			LSTAT(sp->walks++);
+			r = tenants_lookup(sp->trees, b->tree, pkt);
+			r = r != NULL ? sp->origin[r->id] : NULL;
+			if (r != NULL && (best == NULL || r->id < best->id))
+				best = r;
+			continue;
+		}
+		for (j = 0; j < b->nrules && (best == NULL || b->rules[j]->id < best->id); j++) {
+			LSTAT(sp->compared++);
+			if (match_rule(b->rules[j], pkt)) {
+				best = b->rules[j];
+				break;
+			}
+		}
+	}
+	return best;
+}
+
+
+
+size_t tuples_bytes(TupleSpace *sp)
+{
+	size_t	bytes = sp->ntuples * sizeof(Tuple) + sp->nrules * sizeof(Rule *) + tenants_bytes(sp->trees);
+	Tuple	*t;
+	int		i, j;
+
+	for (i = 0; i < sp->ntuples; i++) {
+		t = &sp->tuples[i];
+		bytes += (t->mask + 1) * sizeof(int) + t->nbuckets * sizeof(TupleBucket);
+		for (j = 0; j < t->nbuckets; j++)
+			bytes += t->buckets[j].rules != NULL ? t->buckets[j].nrules * sizeof(Rule *) : 0;
+	}
+	return bytes;
+}
+
+
+
+void tuples_report(TupleSpace *sp)
+{
+	size_t	bytes = tuples_bytes(sp);
+
+	printf("tuple space: %d tuples, %d buckets, %d port trees, %lu bytes (%.1f/rule)\n",
+			sp->ntuples, sp->nbuckets, sp->ntrees, bytes, (double) bytes / sp->nrules);
+#ifdef LOOKUP_STATS
+	if (sp->lookups > 0) {
+		printf("tuple lookups: %lu, %.2f tuples probed, %.2f rules compared, %.2f port tree walks per lookup\n",
+				sp->lookups, (double) sp->probes / sp->lookups, (double) sp->compared / sp->lookups,
+				(double) sp->walks / sp->lookups);
+	}
+#endif
+}
@@ -0,0 +1,48 @@
+#ifndef TUPLE_H
+#define TUPLE_H
+
+#include "tenant.h"
+
+
+// rules of one address pair of a tuple, by id
+typedef struct {
+	uint32_t	addr[2];		// the masked source and destination
+	int			tree;			// tenant of its port tree in the store, -1 for a rule list
+	int			nrules;
+	Rule		**rules;
+} TupleBucket;
+
+// the rules of one pair of source and destination prefix lengths, hashed by their addresses
+typedef struct {
+	uint8_t		bits[2];
+	int			first_id;		// lowest rule id, the tuples are searched in this order
+	uint32_t	mask;			// #slots - 1
+	int			*slots;			// bucket index, -1 when empty
+	TupleBucket	*buckets;
+	int			nbuckets;
+} Tuple;
+
+// tuple space search on the address prefixes: a packet probes the hash of each tuple and
+// stops at the first tuple whose rules all come after the best match so far. A bucket of more
+// than leaf_rules rules, which then differ on the ports and protocol only, is decided by a
+// band trie of its own; the tries share a tenant store.
+typedef struct {
+	Tuple		*tuples;
+	int			ntuples;
+	TenantSet	*trees;
+	Rule		**origin;		// rule of the rule set by pooled rule id of the store
+	int			nrules, ntrees, nbuckets;
+
+	// lookup counters, with -DLOOKUP_STATS
+	uint64_t	lookups, probes, compared, walks;
+} TupleSpace;
+
+
+TupleSpace* tuples_new(Rule *rules, int nrules, int leaf_rules, int huge);
+void tuples_free(TupleSpace *ts);
+inline
+Rule* tuples_lookup(TupleSpace *ts, Packet *pkt);
+size_t tuples_bytes(TupleSpace *ts);
+void tuples_report(TupleSpace *ts);
+
+#endif
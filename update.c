@@ -0,0 +1,610 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "rule.h"
+#include "update.h"
+
+
+double ms_since(struct timespec *t0);
+
+UpdateLog* updates_new(Rule *rules, int nrules, int leaf_rules, int max_nodes)
+{
+	UpdateLog	*log = calloc(1, sizeof(UpdateLog));
+	int			s;
+
+	log->nslots = nrules;
+	log->leaf_rules = leaf_rules;
+	log->max_nodes = max_nodes;
+	log->rules = malloc(2 * nrules * sizeof(Rule));
+	for (s = 0; s < nrules; s++) {
+		log->rules[s] = log->rules[nrules + s] = rules[s];
+		log->rules[s].id = s;
+		log->rules[nrules + s].id = nrules + s;
+	}
+	set_keep_pruners(1);
+	log->root = build_trie(log->rules, nrules, leaf_rules);
+	log->brules = band_rules_new(log->rules, 2 * nrules);
+	log->own_tbits = calloc(2 * nrules, sizeof(TBits *));
+	log->current = malloc(nrules * sizeof(Rule *));
+	for (s = 0; s < nrules; s++)
+		log->current[s] = &log->rules[s];
+	log->bank = calloc(nrules, 1);
+	log->seq = 1;
+	log->ncores = sysconf(_SC_NPROCESSORS_CONF);
+	if (log->ncores > MAX_CPUS)
+		log->ncores = MAX_CPUS;
+	log->epochs = aligned_alloc(CACHE_LINE, log->ncores * sizeof(CoreEpoch));
+	memset(log->epochs, 0, log->ncores * sizeof(CoreEpoch));
+	return log;
+}
+
+
+
+// free what the last batch replaced, once the cores that took an epoch before it left
+void reclaim(UpdateLog *log)
+{
+	uint32_t	e;
+	int			i;
+
+	for (i = 0; i < log->ncores && log->nretired > 0; i++) {
+		while ((e = __atomic_load_n(&log->epochs[i].seq, __ATOMIC_SEQ_CST)) != 0 && e < log->seq)
+			usleep(50);
+	}
+	for (i = 0; i < log->nretired; i++) {
+		free_node(&log->retired[i].old[log->retired[i].idx]);
+		free(log->retired[i].old);
+	}
+	free(log->retired);
+	log->retired = NULL;
+	log->nretired = 0;
+}
+
+
+
+// free the log and its trie; no core may classify any more
+void updates_free(UpdateLog *log)
+{
+	int		i;
+
+	reclaim(log);
+	free_trie(log->root);
+	build_reset();
+	set_keep_pruners(0);
+	for (i = 0; i < 2 * log->nslots; i++)
+		free(log->own_tbits[i]);
+	free(log->own_tbits);
+	band_rules_free(log->brules, 2 * log->nslots);
+	free(log->rules);
+	free(log->current);
+	free(log->bank);
+	free(log->queue);
+	free(log->epochs);
+	free(log);
+}
+
+
+
+// queue an operation on slot, rule is not used by a delete
+void update_post(UpdateLog *log, int op, int slot, Rule *rule)
+{
+	Update	*u;
+
+	if (log->nqueued == log->queue_size) {
+		log->queue_size = log->queue_size > 0 ? log->queue_size * 2 : 256;
+		log->queue = realloc(log->queue, log->queue_size * sizeof(Update));
+	}
+	u = &log->queue[log->nqueued++];
+	u->op = op;
+	u->slot = slot;
+	if (rule != NULL)
+		u->rule = *rule;
+	log->posted++;
+}
+
+
+
+int same_rule(Rule *a, Rule *b)
+{
+	int		dim;
+
+	for (dim = 0; dim < NFIELDS; dim++) {
+		if (a->field[dim].lo != b->field[dim].lo || a->field[dim].hi != b->field[dim].hi)
+			return 0;
+	}
+	return a->action == b->action;
+}
+
+
+
+// fold the queue into the net change of each slot, in the order the slots were first touched;
+// an add to a live slot replaces its rule, a modify of a deleted slot is dropped, and a slot
+// ending as it started is no change. Return #changes
+int coalesce(UpdateLog *log, SlotChange *changes)
+{
+	SlotChange	*c;
+	Update		*u;
+	int			*pending = malloc(log->nslots * sizeof(int));
+	int			i, n = 0, m = 0;
+
+	memset(pending, -1, log->nslots * sizeof(int));
+	for (i = 0; i < log->nqueued; i++) {
+		u = &log->queue[i];
+		if (pending[u->slot] < 0) {
+			c = &changes[pending[u->slot] = n++];
+			c->slot = u->slot;
+			c->live = log->current[u->slot] != NULL;
+			if (c->live)
+				c->rule = *log->current[u->slot];
+		}
+		c = &changes[pending[u->slot]];
+		if (u->op == UPDATE_DELETE) {
+			c->live = 0;
+		} else if (u->op == UPDATE_ADD || c->live) {
+			c->live = 1;
+			c->rule = u->rule;
+		}
+	}
+	for (i = 0; i < n; i++) {
+		c = &changes[i];
+		if (c->live == (log->current[c->slot] != NULL) &&
+				(!c->live || same_rule(&c->rule, log->current[c->slot])))
+			continue;
+		changes[m++] = *c;
+	}
+	free(pending);
+	return m;
+}
+
+
+
+int cmp_node(const void *a, const void *b)
+{
+	Trie	*x = *(Trie **) a, *y = *(Trie **) b;
+
+	return x < y ? -1 : x > y;
+}
+
+
+
+// sort the roots and drop the duplicates and the roots below another one; return #roots left
+int dedupe_roots(Trie **roots, int n)
+{
+	Trie	*u;
+	char	*below;
+	int		i, m = 0;
+
+	qsort(roots, n, sizeof(Trie *), cmp_node);
+	for (i = 0; i < n; i++) {
+		if (m == 0 || roots[i] != roots[m-1])
+			roots[m++] = roots[i];
+	}
+	below = calloc(m, 1);
+	for (i = 0; i < m; i++) {
+		for (u = roots[i]->parent; u != NULL && !below[i]; u = u->parent)
+			below[i] = bsearch(&u, roots, m, sizeof(Trie *), cmp_node) != NULL;
+	}
+	for (i = n = 0; i < m; i++) {
+		if (!below[i])
+			roots[n++] = roots[i];
+	}
+	free(below);
+	return n;
+}
+
+
+
+// write the new rule of slot to the bank not in use and make it current; the rule there was
+// retired by an earlier batch, no core sees it
+void set_rule(UpdateLog *log, int slot, Rule *rule)
+{
+	BandRule	*br;
+	TBits		*tbits, tmp[MAX_RANGE_TBITS];
+	int			id = (1 - log->bank[slot]) * log->nslots + slot, dim, n = 0;
+
+	log->rules[id] = *rule;
+	log->rules[id].id = id;
+	for (dim = 0; dim < NFIELDS; dim++)
+		n += range_tbits(tmp, dim, rule->field[dim]);
+	tbits = malloc(n * sizeof(TBits));
+	br = &log->brules[id];
+	br->rule = &log->rules[id];
+	for (dim = 0, n = 0; dim < NFIELDS; dim++) {
+		br->tbits[dim] = tbits + n;
+		br->ntbits[dim] = range_tbits(tbits + n, dim, rule->field[dim]);
+		n += br->ntbits[dim];
+	}
+	free(log->own_tbits[id]);
+	log->own_tbits[id] = tbits;
+	log->bank[slot] = 1 - log->bank[slot];
+	log->current[slot] = &log->rules[id];
+}
+
+
+
+// index of the first rule of the list of node v whose slot is not below slot
+int slot_search(UpdateLog *log, Trie *v, int slot)
+{
+	int		lo = 0, hi = v->nrules, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (v->rules[mid]->id % log->nslots < slot)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+
+
+// take the rule out of the list of node v, a node above the roots of a batch
+void list_leave(UpdateLog *log, Trie *v, Rule *rule)
+{
+	int		i = slot_search(log, v, rule->id % log->nslots);
+
+	if (i == v->nrules || v->rules[i] != rule)
+		return;
+	memmove(v->rules + i, v->rules + i + 1, (--v->nrules - i) * sizeof(Rule *));
+}
+
+
+
+// put the rule in the list of node v in priority order, unless behind its full cover
+void list_enter(UpdateLog *log, Trie *v, Rule *rule)
+{
+	int		slot = rule->id % log->nslots, i;
+
+	if (v->full_cover != NULL && v->full_cover->id % log->nslots < slot)
+		return;
+	i = slot_search(log, v, slot);
+	if (i < v->nrules && v->rules[i]->id % log->nslots == slot) {
+		v->rules[i] = rule;
+		return;
+	}
+	v->rules = realloc(v->rules, (v->nrules + 1) * sizeof(Rule *));
+	memmove(v->rules + i + 1, v->rules + i, (v->nrules - i) * sizeof(Rule *));
+	v->rules[i] = rule;
+	v->nrules++;
+}
+
+
+
+// whether the rule was deleted or replaced by a batch
+int stale(UpdateLog *log, Rule *rule)
+{
+	return log->current[rule->id % log->nslots] != rule;
+}
+
+
+
+// the rules held by node v, its list and full cover, as they are now, into out (of at least
+// v->nrules + 1) in priority order; return how many
+int held_rules(UpdateLog *log, Trie *v, Rule **out)
+{
+	Rule	*r;
+	int		i, n = 0;
+
+	for (i = 0; i <= v->nrules; i++) {
+		r = i < v->nrules ? v->rules[i] : v->full_cover;
+		if (r != NULL && (r = log->current[r->id % log->nslots]) != NULL)
+			out[n++] = r;
+	}
+	return n;
+}
+
+
+
+// keep the pruners of v that are still live
+void drop_stale_pruners(UpdateLog *log, Trie *v)
+{
+	int		i, n = 0;
+
+	for (i = 0; i < v->npruners; i++) {
+		if (!stale(log, v->pruners[i]))
+			v->pruners[n++] = v->pruners[i];
+	}
+	v->npruners = n;
+}
+
+
+
+// take the deleted rule out of the lists of the nodes above its roots, parents first (see
+// update_path()). Below a node the rule dropped another rule from, the lists are refilled from
+// the parent, as the rules it hid come back; their ids go to refilled[]
+void path_leave(UpdateLog *log, Trie **path, int npath, Rule *rule, int **refilled, int *n,
+		int *size)
+{
+	Trie	*u, *top[MAX_DEPTH];
+	Rule	**rules;
+	int		i, m;
+
+	for (i = 0; i < npath; i++) {
+		u = path[i];
+		if (!pruned_by(u, rule) && (u->depth == 0 || top[u->depth-1] != u->parent)) {
+			list_leave(log, u, rule);
+			top[u->depth] = NULL;
+			continue;
+		}
+		rules = malloc((u->parent->nrules + 1) * sizeof(Rule *));
+		m = held_rules(log, u->parent, rules);
+		refill_rules(u, rules, m);
+		free(rules);
+		top[u->depth] = u;
+		if (*n == *size) {
+			*size = *size > 0 ? *size * 2 : 64;
+			*refilled = realloc(*refilled, *size * sizeof(int));
+		}
+		(*refilled)[(*n)++] = u->id;
+	}
+}
+
+
+
+int cmp_id(const void *a, const void *b)
+{
+	return *(int *) a - *(int *) b;
+}
+
+
+
+// a rule with its slot, the priority order of the rules of a log
+typedef struct {
+	int			slot;
+	Rule		*rule;
+} SlotRule;
+
+
+int cmp_slot_rule(const void *a, const void *b)
+{
+	return ((SlotRule *) a)->slot - ((SlotRule *) b)->slot;
+}
+
+
+
+// the rules a root v of the batch of the first k changes is rebuilt from, in priority order:
+// those it holds and the new rules of the batch. When a rule v or its parent lost as covered
+// may be back (a pruner or the full cover of v went, or the parent was refilled), the parent
+// has them: its list is what may overlap it, as the lists above the roots follow the batches.
+// v then drops its pruners. The root of the trie takes the rule set. Return #rules in out (of
+// v->nrules + v->parent->nrules + k + 2, or nslots)
+int root_rules(UpdateLog *log, Trie *v, SlotChange *changes, int k, int *refilled,
+		int nrefilled, Rule **out)
+{
+	SlotRule	*sr;
+	int			i, n, up;
+
+	if (v->parent == NULL) {
+		for (i = n = 0; i < log->nslots; i++) {
+			if (log->current[i] != NULL)
+				out[n++] = log->current[i];
+		}
+		return n;
+	}
+	up = v->full_cover != NULL && stale(log, v->full_cover);
+	for (i = 0; i < v->npruners && !up; i++)
+		up = stale(log, v->pruners[i]);
+	if (!up)
+		up = bsearch(&v->parent->id, refilled, nrefilled, sizeof(int), cmp_id) != NULL;
+	n = held_rules(log, v, out);
+	if (up) {
+		n += held_rules(log, v->parent, out + n);
+		free(v->pruners);
+		v->pruners = NULL;
+		v->npruners = 0;
+	}
+	for (i = 0; i < k; i++) {
+		if (changes[i].live)
+			out[n++] = log->current[changes[i].slot];
+	}
+	sr = malloc(n * sizeof(SlotRule));
+	for (i = 0; i < n; i++) {
+		sr[i].slot = out[i]->id % log->nslots;
+		sr[i].rule = out[i];
+	}
+	qsort(sr, n, sizeof(SlotRule), cmp_slot_rule);
+	for (i = k = 0; i < n; i++) {
+		if (k == 0 || sr[i].rule != out[k-1])
+			out[k++] = sr[i].rule;
+	}
+	free(sr);
+	return k;
+}
+
+
+
+// free what the last batch replaced, off the latency of this one, then apply the queued
+// operations up to the node cap. Return #changes applied
+int updates_apply(UpdateLog *log)
+{
+	struct timespec	t0;
+	SlotChange		*changes, *c;
+	Retired			*retired;
+	Rule			**olds, **rules;
+	Trie			**roots = NULL, **next = NULL, **swap, **path = NULL, *v, w;
+	int				*ids, nchanges, nroots = 0, size = 0, nnext, next_size = 0;
+	int				*refilled = NULL, nrefilled = 0, refilled_size = 0, npath, path_size = 0;
+	int				touched = 0, built = 0, i, j, k, n;
+	double			ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	reclaim(log);
+	log->reclaim_ms += ms_since(&t0);
+	if (log->nqueued == 0)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	changes = malloc(log->nqueued * sizeof(SlotChange));
+	nchanges = coalesce(log, changes);
+	log->coalesced += log->nqueued - nchanges;
+
+	// the changes in order while the subtrees they touch stay within the cap, at least one
+	for (k = 0; k < nchanges; k++) {
+		c = &changes[k];
+		if (next_size < nroots) {
+			next_size = nroots;
+			next = realloc(next, next_size * sizeof(Trie *));
+		}
+		memcpy(next, roots, nroots * sizeof(Trie *));
+		nnext = nroots;
+		if (log->current[c->slot] != NULL)
+			update_roots(log->root, log->current[c->slot], &next, &nnext, &next_size);
+		if (c->live)
+			update_roots(log->root, &c->rule, &next, &nnext, &next_size);
+		nnext = dedupe_roots(next, nnext);
+		for (i = touched = 0; i < nnext; i++)
+			touched += subtree_nodes(next[i]);
+		if (log->max_nodes > 0 && touched > log->max_nodes && k > 0) {
+			log->capped++;
+			break;
+		}
+		swap = roots;
+		roots = next;
+		next = swap;
+		i = size;
+		size = next_size;
+		next_size = i;
+		nroots = nnext;
+	}
+	free(next);
+	for (i = touched = 0; i < nroots; i++)
+		touched += subtree_nodes(roots[i]);
+
+	// the rest stays queued as one operation per slot
+	log->nqueued = 0;
+	for (i = k; i < nchanges; i++) {
+		log->queue[log->nqueued].op = changes[i].live ? UPDATE_ADD : UPDATE_DELETE;
+		log->queue[log->nqueued].slot = changes[i].slot;
+		log->queue[log->nqueued++].rule = changes[i].rule;
+	}
+	if (k == 0) {
+		free(changes);
+		free(roots);
+		return 0;
+	}
+
+	// the new rules, and the lists above the roots moved to them before any publish copies the
+	// nodes holding them; the lookups do not read the lists of inner nodes
+	olds = malloc(k * sizeof(Rule *));
+	for (i = 0; i < k; i++) {
+		olds[i] = log->current[changes[i].slot];
+		if (changes[i].live)
+			set_rule(log, changes[i].slot, &changes[i].rule);
+		else
+			log->current[changes[i].slot] = NULL;
+	}
+	for (i = 0; i < k; i++) {
+		if (olds[i] != NULL) {
+			npath = 0;
+			update_path(log->root, olds[i], &path, &npath, &path_size);
+			path_leave(log, path, npath, olds[i], &refilled, &nrefilled, &refilled_size);
+		}
+		if (changes[i].live) {
+			npath = 0;
+			update_path(log->root, log->current[changes[i].slot], &path, &npath, &path_size);
+			for (j = 0; j < npath; j++)
+				list_enter(log, path[j], log->current[changes[i].slot]);
+		}
+	}
+	// a pruner changed by the batch holds until its own rule left the lists
+	for (i = 0; i < nrefilled; i++)
+		drop_stale_pruners(log, trie_nodes[refilled[i]]);
+	qsort(refilled, nrefilled, sizeof(int), cmp_id);
+	free(path);
+	free(olds);
+
+	// the subtrees built from what their roots held and the batch; the roots are found again
+	// by id, as each publish moves the siblings of its root
+	ids = malloc(nroots * sizeof(int));
+	retired = malloc(nroots * sizeof(Retired));
+	for (i = 0; i < nroots; i++)
+		ids[i] = roots[i]->id;
+	for (i = 0; i < nroots; i++) {
+		v = trie_nodes[ids[i]];
+		rules = malloc((v->parent == NULL ? log->nslots :
+					v->nrules + v->parent->nrules + k + 2) * sizeof(Rule *));
+		n = root_rules(log, v, changes, k, refilled, nrefilled, rules);
+		built += rebuild_subtree(v, rules, n, log->leaf_rules, &w);
+		free(rules);
+		retired[i].old = replace_node(v, &w, &log->root);
+		retired[i].idx = v - retired[i].old;
+	}
+	for (i = 0; i < nroots; i++)
+		drop_subtree(&retired[i].old[retired[i].idx]);
+
+	// a core that took an epoch before this one may be on the replaced nodes, the next batch
+	// frees them
+	__atomic_add_fetch(&log->seq, 1, __ATOMIC_SEQ_CST);
+	log->retired = retired;
+	log->nretired = nroots;
+
+	ms = ms_since(&t0);
+	log->total_ms += ms;
+	if (ms > log->max_ms)
+		log->max_ms = ms;
+	if (touched > log->max_touched)
+		log->max_touched = touched;
+	log->nodes_touched += touched;
+	log->nodes_built += built;
+	log->subtrees += nroots;
+	log->batches++;
+	k = nchanges - log->nqueued;
+	log->applied += k;
+	free(ids);
+	free(refilled);
+	free(changes);
+	free(roots);
+	return k;
+}
+
+
+
+// the live rules in priority order into out, their ids those of the lookups; return how many
+int updates_rules(UpdateLog *log, Rule *out)
+{
+	int		s, n = 0;
+
+	for (s = 0; s < log->nslots; s++) {
+		if (log->current[s] != NULL)
+			out[n++] = *log->current[s];
+	}
+	return n;
+}
+
+
+
+// the trie for a batch of lookups on core, matched on log->brules; the core stays on it until
+// updates_release()
+inline Trie* updates_acquire(UpdateLog *log, int core)
+{
+	uint32_t	seq;
+
+	do {
+		seq = __atomic_load_n(&log->seq, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&log->epochs[core].seq, seq, __ATOMIC_SEQ_CST);
+	} while (__atomic_load_n(&log->seq, __ATOMIC_SEQ_CST) != seq);
+	return __atomic_load_n(&log->root, __ATOMIC_ACQUIRE);
+}
+
+
+
+inline void updates_release(UpdateLog *log, int core)
+{
+	__atomic_store_n(&log->epochs[core].seq, 0, __ATOMIC_RELEASE);
+}
+
+
+
+void updates_report(UpdateLog *log)
+{
+	printf("updates: %lu posted, %lu coalesced away, %lu applied in %lu batches (%lu cut at %d nodes)\n",
+			log->posted, log->coalesced, log->applied, log->batches, log->capped, log->max_nodes);
+	if (log->batches == 0)
+		return;
+	printf("batches: %.1f subtrees, %.1f nodes replaced (max %lu), %.1f nodes built; "
+			"latency %.2f ms avg, %.2f ms max; reclaim wait %.2f ms avg\n",
+			(double) log->subtrees / log->batches, (double) log->nodes_touched / log->batches,
+			log->max_touched, (double) log->nodes_built / log->batches,
+			log->total_ms / log->batches, log->max_ms, log->reclaim_ms / log->batches);
+}
@@ -0,0 +1,73 @@
+#ifndef UPDATE_H
+#define UPDATE_H
+
+#include "rebuild.h"
+
+
+enum { UPDATE_ADD, UPDATE_DELETE, UPDATE_MODIFY };
+
+// a rule operation of a controller on a slot of the rule set, whose index is its priority
+typedef struct {
+	int			op;
+	int			slot;
+	Rule		rule;			// fields and action of an add or modify
+} Update;
+
+// the net change of a slot over the queued operations
+typedef struct {
+	int			slot;
+	int			live;			// after the operations
+	Rule		rule;
+} SlotChange;
+
+// a node replaced by a batch: the array (or the root) it is in, and its index there
+typedef struct {
+	Trie		*old;
+	int			idx;
+} Retired;
+
+// rule updates applied to the trie of a rule set, built with build_trie() and its state kept,
+// while cores classify on it; one writer. The queued operations are coalesced into one change
+// per slot and applied in batches: the subtrees the changed rules overlap are rebuilt aside
+// from the rules their roots held and the batch, and swapped in, and what they replaced is
+// freed by the next batch (or updates_free()) once no core is on it; the rule lists of the nodes above them follow in place. A
+// batch stops at the change past max_nodes nodes touched, the rest stays queued.
+//
+// A rule the lookups may still see is never written: each slot has a rule in each of two
+// banks, and a new version goes to the bank not in use.
+typedef struct {
+	Trie		*root;			// what updates_acquire() returns
+	Rule		*rules;			// bank b of slot s at b * nslots + s, the rule id
+	BandRule	*brules;		// by rule id, what the lookups match
+	TBits		**own_tbits;	// by rule id, the tbits written by an update, NULL for the pool
+	Rule		**current;		// by slot, NULL when deleted: the rule set the subtrees are built from
+	uint8_t		*bank;			// by slot
+	int			nslots, leaf_rules, max_nodes;
+
+	Update		*queue;
+	int			nqueued, queue_size;
+	uint32_t	seq;			// bumped by each batch published
+	CoreEpoch	*epochs;		// per core, the seq it classifies on
+	int			ncores;
+	Retired		*retired;		// replaced by the batch of seq
+	int			nretired;
+
+	// counters, read with updates_report()
+	uint64_t	posted, coalesced, applied, batches, capped, subtrees;
+	uint64_t	nodes_touched, max_touched, nodes_built;
+	double		total_ms, max_ms, reclaim_ms;
+} UpdateLog;
+
+
+UpdateLog* updates_new(Rule *rules, int nrules, int leaf_rules, int max_nodes);
+void updates_free(UpdateLog *log);
+void update_post(UpdateLog *log, int op, int slot, Rule *rule);
+int updates_apply(UpdateLog *log);
+int updates_rules(UpdateLog *log, Rule *out);
+inline
+Trie* updates_acquire(UpdateLog *log, int core);
+inline
+void updates_release(UpdateLog *log, int core);
+void updates_report(UpdateLog *log);
+
+#endif